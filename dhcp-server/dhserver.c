@@ -24,16 +24,6 @@
 
 #include "dhserver.h"
 
-/* DHCP message type */
-#define DHCP_DISCOVER       1
-#define DHCP_OFFER          2
-#define DHCP_REQUEST        3
-#define DHCP_DECLINE        4
-#define DHCP_ACK            5
-#define DHCP_NAK            6
-#define DHCP_RELEASE        7
-#define DHCP_INFORM         8
-
 /* DHCP options */
 enum DHCP_OPTIONS
 {
@@ -90,6 +80,8 @@ typedef struct
     uint8_t  dp_options[275]; /* options area */
 } DHCP_TYPE;
 
+_Static_assert(sizeof(DHCP_TYPE) == DHCP_PACKET_SIZE, "DHCP_PACKET_SIZE out of date");
+
 DHCP_TYPE dhcp_data;
 static struct udp_pcb *pcb = NULL;
 static const dhcp_config_t *config = NULL;
@@ -264,11 +256,13 @@ static void udp_recv_proc(void *arg, struct udp_pcb *upcb, struct pbuf *p, const
 				config->router,
 				*netif_ip4_netmask(netif));
 
-			pp = pbuf_alloc(PBUF_TRANSPORT, sizeof(dhcp_data), PBUF_POOL);
+			/* from the heap: the pool is held by the USB receive buffers, and the copy needs one contiguous pbuf */
+			pp = pbuf_alloc(PBUF_TRANSPORT, sizeof(dhcp_data), PBUF_RAM);
 			if (pp == NULL) break;
 			memcpy(pp->payload, &dhcp_data, sizeof(dhcp_data));
 			udp_sendto(upcb, pp, IP_ADDR_BROADCAST, port);
 			pbuf_free(pp);
+			if (config->notify) config->notify(DHCP_OFFER);
 			break;
 
 		case DHCP_REQUEST:
@@ -307,12 +301,13 @@ static void udp_recv_proc(void *arg, struct udp_pcb *upcb, struct pbuf *p, const
 				*netif_ip4_netmask(netif));
 
 			/* 6. send ACK */
-			pp = pbuf_alloc(PBUF_TRANSPORT, sizeof(dhcp_data), PBUF_POOL);
+			pp = pbuf_alloc(PBUF_TRANSPORT, sizeof(dhcp_data), PBUF_RAM);
 			if (pp == NULL) break;
 			memcpy(entry->mac, dhcp_data.dp_chaddr, 6);
 			memcpy(pp->payload, &dhcp_data, sizeof(dhcp_data));
 			udp_sendto(upcb, pp, IP_ADDR_BROADCAST, port);
 			pbuf_free(pp);
+			if (config->notify) config->notify(DHCP_ACK);
 			break;
 
 		default:
@@ -39,6 +39,19 @@
 #include "lwip/udp.h"
 #include "netif/etharp.h"
 
+/* DHCP message type */
+#define DHCP_DISCOVER       1
+#define DHCP_OFFER          2
+#define DHCP_REQUEST        3
+#define DHCP_DECLINE        4
+#define DHCP_ACK            5
+#define DHCP_NAK            6
+#define DHCP_RELEASE        7
+#define DHCP_INFORM         8
+
+/* bytes of dhcp_data, the server's one message buffer */
+#define DHCP_PACKET_SIZE    516
+
 typedef struct dhcp_entry
 {
 	uint8_t  mac[6];
@@ -54,6 +67,7 @@ typedef struct dhcp_config
 	const char   *domain;
 	int           num_entry;
 	dhcp_entry_t *entries;
+	void        (*notify)(int type); /* optional: called after each DHCP_OFFER or DHCP_ACK is sent */
 } dhcp_config_t;
 
 err_t dhserv_init(const dhcp_config_t *config);
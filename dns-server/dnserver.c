@@ -151,7 +151,8 @@ static void udp_recv_proc(void *arg, struct udp_pcb *upcb, struct pbuf *p, const
 	if (!query_proc(query.name, &host_addr)) goto error;
 
 	len += sizeof(dns_header_t);
-	out = pbuf_alloc(PBUF_TRANSPORT, len + 16, PBUF_POOL);
+	/* from the heap, as dhserver.c does: the pool is held by the USB receive buffers */
+	out = pbuf_alloc(PBUF_TRANSPORT, len + 16, PBUF_RAM);
 	if (out == NULL) goto error;
 
 	memcpy(out->payload, p->payload, len);
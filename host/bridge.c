@@ -0,0 +1,762 @@
+/*
+  RNDIS-over-TAP bridge: the firmware (app.c with lwIP, httpd, DHCP and DNS,
+  rndis.c, usb_rndis.c, usb_std.c, usb_descriptors.c) run as a Linux process,
+  with usb_host.c in place of the USB controller and time_host.c in place of
+  SysTick. This file plays the host's RNDIS driver: it brings the function up
+  over the control endpoint as Linux's rndis_host does, then packs the frames
+  from the network side into REMOTE_NDIS_PACKET_MSGs for the bulk OUT endpoint,
+  as many per transfer as the device takes (as Windows does), and writes out
+  the frames of every bulk IN transfer. Transfers are paced at
+  full-speed USB rates, so frames/s and batching come out as against a real host.
+  Built with USB_NCM (make ncm_bridge), the device has usb_ncm.c in place of
+  RNDIS and this file plays cdc_ncm instead, packing frames into NTB16s.
+
+    rndis_bridge tap0          attach to TAP interface tap0, creating it if need be (CAP_NET_ADMIN)
+    rndis_bridge -x command    run command with the other end of a socketpair on fd 3, a frame per
+                               datagram, and exit with its status; no privileges needed
+
+  The TAP interface (or RNDIS_BRIDGE_MAC, for the command) gets the address
+  the device hands the host in OID_802_3_PERMANENT_ADDRESS.
+*/
+
+/* struct ifreq; and since this brings <endian.h>'s BYTE_ORDER, cpu.h's has to come first */
+#define _DEFAULT_SOURCE
+#include <sam.h>
+#include "usb.h"
+#include "usb_std.h"
+#include "usb_descriptors.h"
+#include "usb_host.h"
+#include "usb_ncm.h"
+#include "ndis.h"
+#include "rndis.h"
+#include "time.h"
+#include "lwip/stats.h"
+#include "lwip/memp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/if_tun.h>
+
+#define BRIDGE_MAX_TRANSFER 16384 /* what the bridge says it can take in one IN transfer; the device caps it to its buffer */
+#define BRIDGE_CONTROL_SIZE 1025  /* rndis_host's buffer for GET_ENCAPSULATED_RESPONSE */
+#define BRIDGE_PACKET_NS 52632 /* full-speed bulk moves at most 19 packets of USB_FS_MAX_PACKET_SIZE in a 1 ms frame */
+#define BRIDGE_FILTER (NDIS_PACKET_TYPE_DIRECTED | NDIS_PACKET_TYPE_BROADCAST | NDIS_PACKET_TYPE_ALL_MULTICAST) /* rndis_host's */
+#define BRIDGE_NCM_FILTER (NCM_FILTER_DIRECTED | NCM_FILTER_BROADCAST | NCM_FILTER_ALL_MULTICAST) /* the same, for cdc_ncm */
+#define BRIDGE_NTB_DATAGRAMS 40 /* cdc_ncm's most datagrams in an NTB it sends (CDC_NCM_DPT_DATAGRAMS_MAX) */
+
+#ifndef BRIDGE_TASK_OFFLOAD
+#define BRIDGE_TASK_OFFLOAD 0 /* 1: take up the IPv4 transmit checksum offload the device offers, as Windows does */
+#endif
+
+int app_main(void);
+extern const uint32_t mem_budget_free; /* membudget.c, with this host's pointer and struct sizes */
+
+static const char *bridge_ifname;  /* TAP interface, or */
+static const char *bridge_command; /* the command on the socketpair */
+static pid_t bridge_child;
+static int bridge_fd = -1;
+static bool bridge_up;
+static bool bridge_linked;
+static volatile sig_atomic_t bridge_stopped;
+static uint8_t bridge_hwaddr[6];
+static uint32_t bridge_out_packets = 1, bridge_out_size = RNDIS_BUFFER_SIZE, bridge_out_align = 1; /* from INITIALIZE_CMPLT or GET_NTB_PARAMETERS */
+static uint32_t bridge_bus_free; /* time_cycles() (ns here) when the bus can carry the next bulk transfer */
+static unsigned long bridge_in_transfers, bridge_in_frames; /* how well the device batches */
+
+#if !USB_NCM
+static uint32_t bridge_request_id;
+static alignas(4) uint8_t bridge_response_buf[BRIDGE_CONTROL_SIZE];
+#endif
+static alignas(4) uint8_t bridge_in_buf[BRIDGE_MAX_TRANSFER];
+static alignas(4) uint8_t bridge_out_buf[BRIDGE_MAX_TRANSFER];
+static uint8_t bridge_frame[ETH_MAX_PACKET_SIZE]; /* read from the network side, but not yet packed */
+static int bridge_frame_size;
+
+static void bridge_fail(const char *what)
+{
+  fprintf(stderr, "rndis_bridge: %s%s%s\n", what, errno ? ": " : "", errno ? strerror(errno) : "");
+  exit(1);
+}
+
+static bool bridge_control(uint8_t type, uint8_t request, uint16_t value, void *data, int length, int *size)
+{
+  usb_request_t r = { type, request, value, 0, length };
+  int received;
+
+  if (!usb_host_control(&r, data, &received))
+    return false;
+
+  if (size)
+    *size = received;
+  return true;
+}
+
+#if !USB_NCM
+/* fetch the response the device announced on its interrupt endpoint, NULL if it has announced none */
+static const rndis_generic_msg_t *bridge_response(void)
+{
+  uint8_t notification[8];
+  int size;
+
+  if (!usb_host_ready(USB_IN_ENDPOINT | USB_RNDIS_EP_COMM))
+    return NULL;
+
+  usb_host_in(USB_RNDIS_EP_COMM, notification, sizeof(notification));
+
+  /* GET_ENCAPSULATED_RESPONSE */
+  if (!bridge_control(0xA1, 0x01, 0, bridge_response_buf, sizeof(bridge_response_buf), &size) ||
+      (size < (int)sizeof(rndis_generic_msg_t)))
+    return NULL;
+
+  return (const rndis_generic_msg_t *)bridge_response_buf;
+}
+
+/* SEND_ENCAPSULATED_COMMAND, then responses until the one completing it; status indications in between are dropped */
+static const rndis_initialize_cmplt_t *bridge_request(void *msg)
+{
+  rndis_generic_msg_t *m = msg;
+  const rndis_generic_msg_t *r;
+
+  ((rndis_initialize_msg_t *)msg)->RequestId = ++bridge_request_id;
+
+  if (!bridge_control(0x21, 0x00, 0, msg, m->MessageLength, NULL))
+    return NULL;
+
+  while ((r = bridge_response()))
+  {
+    if ((m->MessageType | 0x80000000) == r->MessageType)
+      return (const rndis_initialize_cmplt_t *)r;
+  }
+
+  return NULL;
+}
+
+/* the completion of a request that succeeded, NULL otherwise */
+static const void *bridge_rndis(void *msg)
+{
+  const rndis_initialize_cmplt_t *r = bridge_request(msg);
+
+  return (r && (RNDIS_STATUS_SUCCESS == r->Status)) ? r : NULL;
+}
+
+/* Windows queries what the device advertises on bind: every OID in OID_GEN_SUPPORTED_LIST must answer, and rndis.c's binary search needs the list ascending */
+static void bridge_check_oids(void)
+{
+  rndis_query_msg_t query = { REMOTE_NDIS_QUERY_MSG, sizeof(query), 0, OID_GEN_SUPPORTED_LIST, 0, 0, 0 };
+  const rndis_query_cmplt_t *list = bridge_rndis(&query);
+  uint32_t oids[RNDIS_RESPONSE_SIZE / 4];
+  int count;
+
+  if (!list || (list->InformationBufferLength % 4) || (list->InformationBufferLength > sizeof(oids)))
+    bridge_fail("no OID_GEN_SUPPORTED_LIST");
+
+  /* bridge_rndis() reuses the response buffer */
+  count = list->InformationBufferLength / 4;
+  memcpy(oids, (const uint8_t *)&list->RequestId + list->InformationBufferOffset, count * 4);
+
+  for (int i = 0; i < count; i++)
+  {
+    query.Oid = oids[i];
+    if ((i && (oids[i - 1] >= oids[i])) || !bridge_rndis(&query))
+    {
+      fprintf(stderr, "rndis_bridge: OID 0x%08x is out of order in OID_GEN_SUPPORTED_LIST or fails its query\n", (unsigned)oids[i]);
+      exit(1);
+    }
+  }
+}
+
+/* malformed sets, which the device must refuse without acting on them */
+static void bridge_check_sets(void)
+{
+  struct
+  {
+    rndis_set_msg_t msg;
+    uint32_t filter;
+  } set = { { REMOTE_NDIS_SET_MSG, sizeof(set), 0, OID_GEN_CURRENT_PACKET_FILTER, 2, sizeof(rndis_set_msg_t) - offsetof(rndis_set_msg_t, RequestId), 0 }, BRIDGE_FILTER };
+  const rndis_initialize_cmplt_t *r = bridge_request(&set);
+
+  if (!r || (RNDIS_STATUS_INVALID_LENGTH != r->Status))
+  {
+    fprintf(stderr, "rndis_bridge: a 2-byte OID_GEN_CURRENT_PACKET_FILTER was not refused with RNDIS_STATUS_INVALID_LENGTH\n");
+    exit(1);
+  }
+
+  /* an offset that wraps offset + length around 2^32, pointing before the message */
+  set.msg.InformationBufferLength = 8;
+  set.msg.InformationBufferOffset = -8u;
+  r = bridge_request(&set);
+  if (!r || (RNDIS_STATUS_INVALID_DATA != r->Status))
+  {
+    fprintf(stderr, "rndis_bridge: an InformationBufferOffset of -8 was not refused with RNDIS_STATUS_INVALID_DATA\n");
+    exit(1);
+  }
+}
+
+#if BRIDGE_TASK_OFFLOAD
+/* the host leaves the IP, TCP and UDP checksums of what it sends to the device, which then skips checking them */
+static void bridge_task_offload(void)
+{
+  struct
+  {
+    rndis_set_msg_t msg;
+    ndis_task_offload_header_t hdr;
+    ndis_task_offload_t task;
+    ndis_task_tcp_ip_checksum_t checksum;
+  } set =
+  {
+    { REMOTE_NDIS_SET_MSG, sizeof(set), 0, OID_TCP_TASK_OFFLOAD, sizeof(set) - sizeof(set.msg), sizeof(rndis_set_msg_t) - offsetof(rndis_set_msg_t, RequestId), 0 },
+    { NDIS_TASK_OFFLOAD_VERSION, sizeof(set.hdr), 0, sizeof(set.hdr), NDIS_ENCAPSULATION_IEEE_802_3, 0, ETH_HEADER_SIZE },
+    { NDIS_TASK_OFFLOAD_VERSION, NDIS_TASK_OFFLOAD_SIZE, NDIS_TASK_TCP_IP_CHECKSUM, 0, sizeof(set.checksum) },
+    { NDIS_TASK_CHECKSUM_IP | NDIS_TASK_CHECKSUM_TCP | NDIS_TASK_CHECKSUM_UDP, 0, 0, 0 }
+  };
+
+  if (!bridge_rndis(&set))
+    bridge_fail("OID_TCP_TASK_OFFLOAD was refused");
+}
+#endif
+
+/* what rndis_host does on bind: configure, INITIALIZE, read the MAC address, open the packet filter */
+static void bridge_bring_up(void)
+{
+  rndis_initialize_msg_t init = { REMOTE_NDIS_INITIALIZE_MSG, sizeof(init), 0, RNDIS_MAJOR_VERSION, RNDIS_MINOR_VERSION, BRIDGE_MAX_TRANSFER };
+  rndis_query_msg_t query = { REMOTE_NDIS_QUERY_MSG, sizeof(query), 0, OID_802_3_PERMANENT_ADDRESS, 0, 0, 0 };
+  struct
+  {
+    rndis_set_msg_t msg;
+    uint32_t filter;
+  } set = { { REMOTE_NDIS_SET_MSG, sizeof(set), 0, OID_GEN_CURRENT_PACKET_FILTER, 4, sizeof(rndis_set_msg_t) - offsetof(rndis_set_msg_t, RequestId), 0 }, BRIDGE_FILTER };
+  const rndis_initialize_cmplt_t *cmplt;
+  const rndis_query_cmplt_t *mac;
+
+  usb_host_reset();
+
+  errno = 0;
+  if (!bridge_control(0x00, USB_SET_ADDRESS, 1, NULL, 0, NULL) ||
+      !bridge_control(0x00, USB_SET_CONFIGURATION, USB_CONFIG_RNDIS, NULL, 0, NULL))
+    bridge_fail("the device did not take its RNDIS configuration");
+
+  cmplt = bridge_rndis(&init);
+  if (!cmplt)
+    bridge_fail("REMOTE_NDIS_INITIALIZE_MSG failed");
+
+  /* how Windows packs OUT transfers; rndis_host sends a frame per transfer, which is this with MaxPacketsPerTransfer 1 */
+  bridge_out_packets = cmplt->MaxPacketsPerTransfer ? cmplt->MaxPacketsPerTransfer : 1;
+  bridge_out_size = LIMIT(cmplt->MaxTransferSize, sizeof(bridge_out_buf));
+  bridge_out_align = 1u << LIMIT(cmplt->PacketAlignmentFactor, 7);
+
+  mac = bridge_rndis(&query);
+  if (!mac || (mac->InformationBufferLength != sizeof(bridge_hwaddr)))
+    bridge_fail("no OID_802_3_PERMANENT_ADDRESS");
+  memcpy(bridge_hwaddr, (const uint8_t *)&mac->RequestId + mac->InformationBufferOffset, sizeof(bridge_hwaddr));
+
+  bridge_check_oids();
+  bridge_check_sets();
+#if BRIDGE_TASK_OFFLOAD
+  bridge_task_offload();
+#endif
+
+  if (!bridge_rndis(&set))
+    bridge_fail("OID_GEN_CURRENT_PACKET_FILTER was refused");
+}
+
+/* status indications: fetched so that later responses are announced, otherwise of no interest */
+static void bridge_notifications(void)
+{
+  while (bridge_response())
+    ;
+}
+#else
+/* what cdc_ncm does on bind: configure, read the MAC address string and the NTB parameters, open the data interface and the packet filter */
+static void bridge_bring_up(void)
+{
+  usb_request_t set_interface = { 0x01, USB_SET_INTERFACE, 1, 1, 0 };
+  alignas(4) ncm_ntb_parameters_t ntb;
+  uint8_t mac[2 + 4 * sizeof(bridge_hwaddr)];
+  int size;
+
+  usb_host_reset();
+
+  errno = 0;
+  if (!bridge_control(0x00, USB_SET_ADDRESS, 1, NULL, 0, NULL) ||
+      !bridge_control(0x00, USB_SET_CONFIGURATION, USB_CONFIG_NCM, NULL, 0, NULL))
+    bridge_fail("the device did not take its NCM configuration");
+
+  /* iMACAddress: twelve hex digits in UTF-16LE */
+  if (!bridge_control(0x80, USB_GET_DESCRIPTOR, (USB_STRING_DESCRIPTOR << 8) | USB_STR_MAC_ADDRESS, mac, sizeof(mac), &size) ||
+      (size != sizeof(mac)))
+    bridge_fail("no iMACAddress string");
+  for (int i = 0; i < (int)sizeof(bridge_hwaddr); i++)
+  {
+    char digits[3] = { mac[2 + 4 * i], mac[4 + 4 * i], 0 };
+
+    bridge_hwaddr[i] = strtoul(digits, NULL, 16);
+  }
+
+  if (!bridge_control(0xA1, NCM_GET_NTB_PARAMETERS, 0, &ntb, sizeof(ntb), &size) || (size != sizeof(ntb)) ||
+      !(ntb.bmNtbFormatsSupported & 1))
+    bridge_fail("no NTB16 in GET_NTB_PARAMETERS");
+
+  bridge_out_packets = ntb.wNtbOutMaxDatagrams ? LIMIT(ntb.wNtbOutMaxDatagrams, BRIDGE_NTB_DATAGRAMS) : BRIDGE_NTB_DATAGRAMS;
+  bridge_out_size = LIMIT(ntb.dwNtbOutMaxSize, sizeof(bridge_out_buf));
+  bridge_out_align = (ntb.wNdpOutDivisor >= 4) ? LIMIT(ntb.wNdpOutDivisor, 64) : 4;
+
+  if (!usb_host_control(&set_interface, NULL, &size))
+    bridge_fail("the device did not open its data interface");
+
+  if (!bridge_control(0x21, NCM_SET_ETHERNET_PACKET_FILTER, BRIDGE_NCM_FILTER, NULL, 0, NULL))
+    bridge_fail("SET_ETHERNET_PACKET_FILTER was refused");
+}
+
+/* the speed and connection notifications, of no interest here */
+static void bridge_notifications(void)
+{
+  uint8_t notification[sizeof(ncm_notification_t)];
+
+  while (usb_host_ready(USB_IN_ENDPOINT | USB_NCM_EP_COMM))
+    usb_host_in(USB_NCM_EP_COMM, notification, sizeof(notification));
+}
+#endif
+
+static void bridge_stop(int sig)
+{
+  (void)sig;
+  bridge_stopped = 1;
+}
+
+static void bridge_open_tap(void)
+{
+  struct ifreq ifr;
+
+  bridge_fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+  if (bridge_fd < 0)
+    bridge_fail("/dev/net/tun");
+
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  strncpy(ifr.ifr_name, bridge_ifname, IFNAMSIZ - 1);
+  if (ioctl(bridge_fd, TUNSETIFF, &ifr) < 0)
+    bridge_fail(bridge_ifname);
+
+  ifr.ifr_hwaddr.sa_family = ARPHRD_ETHER;
+  memcpy(ifr.ifr_hwaddr.sa_data, bridge_hwaddr, sizeof(bridge_hwaddr));
+  if (ioctl(bridge_fd, SIOCSIFHWADDR, &ifr) < 0)
+    bridge_fail("setting the MAC address");
+
+  /* poll() returns early on these, and usb_host_task() finishes */
+  signal(SIGINT, bridge_stop);
+  signal(SIGTERM, bridge_stop);
+
+  fprintf(stderr, "rndis_bridge: %s is up; bring it up on the host side and ask it for DHCP\n", ifr.ifr_name);
+}
+
+static void bridge_open_command(void)
+{
+  char mac[18];
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+    bridge_fail("socketpair");
+
+  snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x",
+      bridge_hwaddr[0], bridge_hwaddr[1], bridge_hwaddr[2], bridge_hwaddr[3], bridge_hwaddr[4], bridge_hwaddr[5]);
+
+  bridge_child = fork();
+  if (bridge_child < 0)
+    bridge_fail("fork");
+
+  if (0 == bridge_child)
+  {
+    close(sv[0]);
+    if (3 != sv[1])
+    {
+      dup2(sv[1], 3);
+      close(sv[1]);
+    }
+    setenv("RNDIS_BRIDGE_MAC", mac, 1);
+    execl("/bin/sh", "sh", "-c", bridge_command, (char *)NULL);
+    _exit(127);
+  }
+
+  close(sv[1]);
+  bridge_fd = sv[0];
+  fcntl(bridge_fd, F_SETFL, O_NONBLOCK);
+
+  /* the command going away shows up as the end of the socket */
+  signal(SIGPIPE, SIG_IGN);
+}
+
+#if LWIP_PERF
+/* with LWIP_PERF, each timed path's cost per call, and how full lwIP's heap and pools got */
+static void bridge_perf(void)
+{
+  static const struct { const char *name; memp_t pool; } pools[] =
+  {
+#define LWIP_MEMPOOL(name, num, size, desc) { #name, MEMP_##name },
+#include "lwip/priv/memp_std.h"
+  };
+  const perf_stat_t *stat;
+  unsigned i;
+
+  for (stat = perf_stats; (stat < &perf_stats[PERF_SLOTS]) && stat->name; stat++)
+    fprintf(stderr, "rndis_bridge: %-22s %8lu calls, %6lu ns mean, %7lu ns max\n",
+        stat->name, (unsigned long)stat->count, (unsigned long)(stat->total / stat->count), (unsigned long)stat->max);
+
+  fprintf(stderr, "rndis_bridge: lwIP heap peak %lu of %lu bytes; pools at peak:",
+      (unsigned long)lwip_stats.mem.max, (unsigned long)lwip_stats.mem.avail);
+  for (i = 0; i < sizeof(pools) / sizeof(pools[0]); i++)
+    if (lwip_stats.memp[pools[i].pool]->max)
+      fprintf(stderr, " %s %u/%u", pools[i].name, (unsigned)lwip_stats.memp[pools[i].pool]->max, (unsigned)lwip_stats.memp[pools[i].pool]->avail);
+  fprintf(stderr, "\n");
+}
+#endif
+
+/* the command closed its end, or the TAP bridge was stopped: finish with the command's status */
+static void bridge_exit(void)
+{
+  int status = 0;
+
+  fprintf(stderr, "rndis_bridge: %lu frames in %lu IN transfers; device rxok %lu rxnobuf %lu rxqueuemax %u, txok %lu txbad %lu, ",
+      bridge_in_frames, bridge_in_transfers, (unsigned long)usb_eth_stat.rxok, (unsigned long)usb_eth_stat.rxnobuf, (unsigned)usb_eth_stat.rxqueuemax,
+      (unsigned long)usb_eth_stat.txok, (unsigned long)usb_eth_stat.txbad);
+#if !USB_NCM
+  fprintf(stderr, "%u sent in place %u copied %u dropped\n",
+      (unsigned)usb_rndis_xmit_stat.zero_copy, (unsigned)usb_rndis_xmit_stat.copied, (unsigned)usb_rndis_xmit_stat.dropped);
+#else
+  fprintf(stderr, "%u NTBs out (%u bad) with %u datagrams, %u in with %u, %u dropped\n",
+      (unsigned)usb_ncm_stat.ntb_out, (unsigned)usb_ncm_stat.ntb_bad, (unsigned)usb_ncm_stat.dgram_out,
+      (unsigned)usb_ncm_stat.ntb_in, (unsigned)usb_ncm_stat.dgram_in, (unsigned)usb_ncm_stat.dropped);
+#endif
+  fprintf(stderr, "rndis_bridge: static RAM budget %lu bytes, %lu free of %lu\n",
+      (unsigned long)(HMCRAMC0_SIZE - mem_budget_free), (unsigned long)mem_budget_free, (unsigned long)HMCRAMC0_SIZE);
+  if (http_stat.requests)
+    fprintf(stderr, "rndis_bridge: httpd served %lu files, %llu bytes; lwIP RAM added per request %lu at most, %lu by the last\n",
+        (unsigned long)http_stat.requests, (unsigned long long)http_stat.file_bytes, (unsigned long)http_stat.ram_max, (unsigned long)http_stat.ram_last);
+#if LWIP_PERF
+  bridge_perf();
+#endif
+
+  if (!bridge_child)
+    exit(0);
+
+  if ((waitpid(bridge_child, &status, 0) == bridge_child) && WIFEXITED(status))
+    exit(WEXITSTATUS(status));
+
+  exit(1);
+}
+
+/*
+  bulk transfers take the bus time they would at full speed, so that the device
+  queues and batches frames as it does against a real host; a transfer is a
+  string of 64-byte packets ended by a short (maybe empty) one
+*/
+static bool bridge_bus_idle(void)
+{
+  return (int32_t)(time_cycles() - bridge_bus_free) >= 0;
+}
+
+static void bridge_bus_take(int size)
+{
+  bridge_bus_free = time_cycles() + (size / USB_FS_MAX_PACKET_SIZE + 1) * BRIDGE_PACKET_NS;
+}
+
+/* a frame from the device to the network side */
+static void bridge_write(const uint8_t *frame, int size)
+{
+  /* like a NIC, the network side simply loses frames it has no room for */
+  if (write(bridge_fd, frame, size) < 0 && (EAGAIN != errno) && (EIO != errno) && (EPIPE != errno))
+    bridge_fail("write");
+
+  bridge_in_frames++;
+}
+
+#if !USB_NCM
+/* an IN transfer holds one or more REMOTE_NDIS_PACKET_MSGs, each MessageLength long including its padding */
+static bool bridge_unpack_transfer(const uint8_t *data, int size)
+{
+  int offset = 0;
+
+  while (size - offset >= (int)sizeof(rndis_data_packet_t))
+  {
+    const rndis_data_packet_t *p = (const rndis_data_packet_t *)(data + offset);
+    uint32_t start = offsetof(rndis_data_packet_t, DataOffset) + p->DataOffset;
+
+    if ((REMOTE_NDIS_PACKET_MSG != p->MessageType) || (p->MessageLength < sizeof(rndis_data_packet_t)) ||
+        (p->MessageLength > (uint32_t)(size - offset)) || (start + p->DataLength > p->MessageLength))
+      return false;
+
+    bridge_write((const uint8_t *)p + start, p->DataLength);
+    offset += p->MessageLength;
+  }
+
+  return true;
+}
+#else
+/* an IN transfer is one NTB16: its NTH16 points at a chain of NDP16s, each listing datagrams up to a null entry */
+static bool bridge_unpack_transfer(const uint8_t *data, int size)
+{
+  const ncm_nth16_t *nth = (const ncm_nth16_t *)data;
+  int ndp_index;
+
+  if ((size < (int)sizeof(ncm_nth16_t)) || (NTH16_SIGNATURE != nth->dwSignature) ||
+      (sizeof(ncm_nth16_t) != nth->wHeaderLength) || (nth->wBlockLength > size))
+    return false;
+
+  for (ndp_index = nth->wNdpIndex; ndp_index; )
+  {
+    const ncm_ndp16_t *ndp = (const ncm_ndp16_t *)(data + ndp_index);
+    int entries;
+
+    if ((ndp_index & 3) || (ndp_index + (int)sizeof(ncm_ndp16_t) > size) || (NDP16_SIGNATURE != ndp->dwSignature) ||
+        (ndp->wLength < sizeof(ncm_ndp16_t) + 2 * sizeof(ncm_datagram16_t)) || (ndp_index + ndp->wLength > size))
+      return false;
+
+    entries = (ndp->wLength - sizeof(ncm_ndp16_t)) / sizeof(ncm_datagram16_t);
+    for (int i = 0; (i < entries) && ndp->datagram[i].wDatagramIndex && ndp->datagram[i].wDatagramLength; i++)
+    {
+      if (ndp->datagram[i].wDatagramIndex + ndp->datagram[i].wDatagramLength > size)
+        return false;
+
+      bridge_write(data + ndp->datagram[i].wDatagramIndex, ndp->datagram[i].wDatagramLength);
+    }
+
+    if (ndp->wNextNdpIndex && (ndp->wNextNdpIndex <= ndp_index))
+      return false;
+    ndp_index = ndp->wNextNdpIndex;
+  }
+
+  return true;
+}
+#endif
+
+static void bridge_unpack(const uint8_t *data, int size)
+{
+  /* a host only sees a transfer end at a short packet or a full buffer: it would run the next transfer into this one */
+  if (!(size % USB_FS_MAX_PACKET_SIZE) && (size < BRIDGE_MAX_TRANSFER))
+  {
+    fprintf(stderr, "rndis_bridge: a %d-byte IN transfer ends on a packet boundary with no short packet\n", size);
+    exit(1);
+  }
+
+  bridge_in_transfers++;
+
+  if (!bridge_unpack_transfer(data, size))
+    fprintf(stderr, "rndis_bridge: malformed IN transfer dropped\n");
+}
+
+/* the next frame from the network side into bridge_frame; false when there is none */
+static bool bridge_read(void)
+{
+  ssize_t size = read(bridge_fd, bridge_frame, sizeof(bridge_frame));
+
+  if (0 == size)
+    bridge_exit();
+
+  if (size < 0)
+  {
+    if (EAGAIN != errno)
+      bridge_fail("read");
+    return false;
+  }
+
+  bridge_frame_size = size;
+  return true;
+}
+
+#if !USB_NCM
+/* the frames waiting on the network side into the armed OUT transfer, as many as the device takes in one; false when there are none */
+static bool bridge_pack(void)
+{
+  rndis_data_packet_t *hdr = NULL;
+  uint32_t size = 0, count = 0;
+
+  while ((count < bridge_out_packets) && (bridge_frame_size || bridge_read()))
+  {
+    uint32_t offset = (size + bridge_out_align - 1) & ~(bridge_out_align - 1);
+
+    /* a frame that does not fit waits for the next transfer */
+    if (count && (offset + sizeof(rndis_data_packet_t) + bridge_frame_size > bridge_out_size))
+      break;
+
+    if (count)
+    {
+      memset(bridge_out_buf + size, 0, offset - size);
+      hdr->MessageLength += offset - size;
+    }
+
+    hdr = (rndis_data_packet_t *)(bridge_out_buf + offset);
+    memset(hdr, 0, sizeof(rndis_data_packet_t));
+    hdr->MessageType = REMOTE_NDIS_PACKET_MSG;
+    hdr->MessageLength = sizeof(rndis_data_packet_t) + bridge_frame_size;
+    hdr->DataOffset = sizeof(rndis_data_packet_t) - offsetof(rndis_data_packet_t, DataOffset);
+    hdr->DataLength = bridge_frame_size;
+    memcpy(hdr + 1, bridge_frame, bridge_frame_size);
+
+    size = offset + hdr->MessageLength;
+    bridge_frame_size = 0;
+    count++;
+  }
+
+  if (!count)
+    return false;
+
+  usb_host_out(USB_RNDIS_EP_RECV, bridge_out_buf, size);
+  bridge_bus_take(size);
+  return true;
+}
+#else
+/* likewise into an NTB16: the NTH16, each datagram at a multiple of wNdpOutDivisor, then the NDP16 listing them */
+static bool bridge_pack(void)
+{
+  static uint16_t sequence;
+  ncm_nth16_t *nth = (ncm_nth16_t *)bridge_out_buf;
+  ncm_ndp16_t *ndp;
+  ncm_datagram16_t datagram[BRIDGE_NTB_DATAGRAMS];
+  uint32_t size = sizeof(ncm_nth16_t), count = 0, ndp_index;
+
+  while ((count < bridge_out_packets) && (bridge_frame_size || bridge_read()))
+  {
+    uint32_t index = (size + bridge_out_align - 1) / bridge_out_align * bridge_out_align;
+
+    /* a frame that does not fit, with the NDP16 and its null entry behind it, waits for the next transfer */
+    if (count && (((index + bridge_frame_size + 3) & ~3u) + sizeof(ncm_ndp16_t) + (count + 2) * sizeof(ncm_datagram16_t) > bridge_out_size))
+      break;
+
+    memset(bridge_out_buf + size, 0, index - size);
+    memcpy(bridge_out_buf + index, bridge_frame, bridge_frame_size);
+    datagram[count].wDatagramIndex = index;
+    datagram[count].wDatagramLength = bridge_frame_size;
+
+    size = index + bridge_frame_size;
+    bridge_frame_size = 0;
+    count++;
+  }
+
+  if (!count)
+    return false;
+
+  ndp_index = (size + 3) & ~3u;
+  memset(bridge_out_buf + size, 0, ndp_index - size);
+  ndp = (ncm_ndp16_t *)(bridge_out_buf + ndp_index);
+  ndp->dwSignature = NDP16_SIGNATURE;
+  ndp->wLength = sizeof(ncm_ndp16_t) + (count + 1) * sizeof(ncm_datagram16_t);
+  ndp->wNextNdpIndex = 0;
+  memcpy(ndp->datagram, datagram, count * sizeof(ncm_datagram16_t));
+  memset(&ndp->datagram[count], 0, sizeof(ncm_datagram16_t));
+  size = ndp_index + ndp->wLength;
+
+  nth->dwSignature = NTH16_SIGNATURE;
+  nth->wHeaderLength = sizeof(ncm_nth16_t);
+  nth->wSequence = sequence++;
+  nth->wBlockLength = size;
+  nth->wNdpIndex = ndp_index;
+
+  usb_host_out(USB_NCM_EP_RECV, bridge_out_buf, size);
+  bridge_bus_take(size);
+  return true;
+}
+#endif
+
+/* project/time.c's time-to-link trace, printed once the host has its address */
+static void bridge_print_link(void)
+{
+  static const char *const phases[TIME_LINK_PHASES] =
+  {
+    "USB reset", "SET_CONFIGURATION", "RNDIS INITIALIZE", "packet filter", "DHCP OFFER", "DHCP ACK",
+  };
+
+  fprintf(stderr, "rndis_bridge: time to link, in ms after the USB reset:");
+  for (int i = TIME_LINK_SET_CONFIGURATION; i < TIME_LINK_PHASES; i++)
+  {
+#if USB_NCM
+    /* no INITIALIZE in NCM */
+    if (TIME_LINK_RNDIS_INITIALIZE == i)
+      continue;
+#endif
+    fprintf(stderr, " %s %u%s", phases[i], (unsigned)(time_link[i] - time_link[TIME_LINK_USB_RESET]), (i + 1 < TIME_LINK_PHASES) ? "," : "\n");
+  }
+}
+
+void usb_host_task(void)
+{
+  if (bridge_stopped)
+    bridge_exit();
+
+  if (!bridge_up)
+  {
+    bridge_bring_up();
+    if (bridge_ifname)
+      bridge_open_tap();
+    else
+      bridge_open_command();
+    bridge_up = true;
+  }
+
+  while (bridge_bus_idle() && usb_host_ready(USB_IN_ENDPOINT | USB_RNDIS_EP_SEND))
+  {
+    int size = usb_host_in(USB_RNDIS_EP_SEND, bridge_in_buf, sizeof(bridge_in_buf));
+
+    bridge_bus_take(size);
+    bridge_unpack(bridge_in_buf, size);
+  }
+
+  bridge_notifications();
+
+  /* no more than the device has banks for, so that lwIP runs between them as it would with real USB */
+  for (int i = 0; (i < USB_RNDIS_RX_BANKS) && bridge_bus_idle() && usb_host_ready(USB_RNDIS_EP_RECV); i++)
+  {
+    if (!bridge_pack())
+      break;
+  }
+
+  if (!bridge_linked && time_link[TIME_LINK_DHCP_ACK])
+  {
+    bridge_print_link();
+    bridge_linked = true;
+  }
+}
+
+bool usb_host_pending(void)
+{
+  return !bridge_up || usb_host_ready(USB_IN_ENDPOINT | USB_RNDIS_EP_SEND) || usb_host_ready(USB_IN_ENDPOINT | USB_RNDIS_EP_COMM) ||
+      (bridge_frame_size && usb_host_ready(USB_RNDIS_EP_RECV));
+}
+
+void usb_host_wait(uint32_t ms)
+{
+  /* with no OUT transfer armed a frame could not be taken, so only the time is waited out */
+  struct pollfd pfd = { usb_host_ready(USB_RNDIS_EP_RECV) ? bridge_fd : -1, POLLIN, 0 };
+
+  /* a transfer on the bus ends within a couple of milliseconds: return, and usb_task() polls until it has */
+  if (!bridge_bus_idle())
+    return;
+
+  poll(&pfd, 1, (ms > INT_MAX) ? INT_MAX : (int)ms);
+}
+
+int main(int argc, char *argv[])
+{
+  if ((2 == argc) && ('-' != argv[1][0]))
+    bridge_ifname = argv[1];
+  else if ((3 == argc) && !strcmp(argv[1], "-x"))
+    bridge_command = argv[2];
+  else
+  {
+    fprintf(stderr, "usage: %s <tap interface>\n       %s -x <command with the frames on fd 3>\n", argv[0], argv[0]);
+    return 2;
+  }
+
+  return app_main();
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+# the host's side of "rndis_bridge -x": ARP, ping, packet-sized replies, DHCP, DNS, then a ping flood for frames/s
+
+import os
+import socket
+import struct
+import sys
+import time
+
+HOST = socket.inet_aton('192.168.7.2')
+DEVICE = socket.inet_aton('192.168.7.1')
+FLOOD_FRAMES = 4000
+FLOOD_WINDOW = 8 # echoes in flight: one packed OUT transfer, whose replies the transmit queue can hold
+
+sock = socket.socket(fileno=3)
+sock.settimeout(3)
+mac = bytes.fromhex(os.environ['RNDIS_BRIDGE_MAC'].replace(':', ''))
+device_mac = b'\xff' * 6
+
+
+def checksum(data):
+    if len(data) % 2:
+        data += b'\0'
+    s = sum(struct.unpack('!%dH' % (len(data) // 2), data))
+    s = (s >> 16) + (s & 0xffff)
+    s += s >> 16
+    return ~s & 0xffff
+
+
+def ipv4(proto, src, dst, payload, dst_mac=None):
+    header = struct.pack('!BBHHHBBH4s4s', 0x45, 0, 20 + len(payload), 0, 0, 64, proto, 0, src, dst)
+    header = header[:10] + struct.pack('!H', checksum(header)) + header[12:]
+    return (dst_mac or device_mac) + mac + b'\x08\x00' + header + payload
+
+
+def udp(src, dst, sport, dport, payload, dst_mac=None):
+    return ipv4(17, src, dst, struct.pack('!HHHH', sport, dport, 8 + len(payload), 0) + payload, dst_mac)
+
+
+def echo(ident, seq, payload):
+    icmp = struct.pack('!BBHHH', 8, 0, 0, ident, seq) + payload
+    return ipv4(1, HOST, DEVICE, icmp[:2] + struct.pack('!H', checksum(icmp)) + icmp[4:])
+
+
+def receive(match):
+    """the next frame match() accepts, answering the device's ARP requests for the host on the way"""
+    while True:
+        frame = sock.recv(2048)
+        if not frame:
+            sys.exit('check.py: the bridge closed the socket')
+        if frame[12:14] == b'\x08\x06' and frame[20:22] == b'\0\x01' and frame[38:42] == HOST:
+            sock.send(frame[6:12] + mac + b'\x08\x06' + frame[14:20] + b'\0\x02' + mac + HOST + frame[22:32])
+            continue
+        result = match(frame)
+        if result is not None:
+            return result
+
+
+def udp_reply(port):
+    return receive(lambda f: f[42:] if f[12:14] == b'\x08\x00' and f[23] == 17 and f[36:38] == struct.pack('!H', port) else None)
+
+
+def echo_reply(f):
+    return struct.unpack('!H', f[40:42])[0] if f[12:14] == b'\x08\x00' and f[23] == 1 and f[34] == 0 else None
+
+
+def check_arp():
+    global device_mac
+    sock.send(b'\xff' * 6 + mac + b'\x08\x06' + struct.pack('!HHBBH', 1, 0x0800, 6, 4, 1) + mac + HOST + b'\0' * 6 + DEVICE)
+    device_mac = receive(lambda f: f[22:28] if f[12:14] == b'\x08\x06' and f[20:22] == b'\0\x02' else None)
+    print('ARP: 192.168.7.1 is at', device_mac.hex(':'))
+
+
+def check_ping():
+    for seq in range(10):
+        payload = os.urandom(1400)
+        sock.send(echo(1, seq, payload))
+        receive(lambda f: True if echo_reply(f) == seq and f[42:] == payload else None)
+    print('ICMP: 10 of 10 1400-byte echoes answered')
+
+
+def check_packet_ends():
+    # each reply is a 44-byte REMOTE_NDIS_PACKET_MSG header and a 42-byte frame header ahead of the payload:
+    # these end on a 64-byte packet boundary, so the device must pad them instead of leaving the host waiting
+    for n in range(2, 25):
+        payload = os.urandom(64 * n - 86)
+        sock.send(echo(3, n, payload))
+        receive(lambda f: True if echo_reply(f) == n and f[42:] == payload else None)
+    print('ICMP: 23 of 23 echoes ending on a USB packet boundary answered')
+
+
+def check_dhcp():
+    bootp = struct.pack('!BBBBIHH16s16s64s128s', 1, 1, 6, 0, 0x5a5a, 0, 0x8000, b'', mac, b'', b'') + b'\x63\x82\x53\x63'
+    sock.send(udp(b'\0' * 4, b'\xff' * 4, 68, 67, bootp + bytes([53, 1, 1, 255]), b'\xff' * 6))
+    offer = udp_reply(68)[16:20]
+    sock.send(udp(b'\0' * 4, b'\xff' * 4, 68, 67, bootp + bytes([53, 1, 3, 50, 4]) + offer + bytes([255]), b'\xff' * 6))
+    ack = udp_reply(68)[16:20]
+    print('DHCP: offered', socket.inet_ntoa(offer) + ', acknowledged', socket.inet_ntoa(ack))
+
+
+def check_dns():
+    query = struct.pack('!HHHHHH', 7, 0x100, 1, 0, 0, 0) + b'\x03run\x03sam\x00' + struct.pack('!HH', 1, 1)
+    sock.send(udp(HOST, DEVICE, 5353, 53, query))
+    answer = udp_reply(5353)
+    print('DNS: run.sam is', socket.inet_ntoa(answer[-4:]))
+
+
+def flood():
+    payload = bytes(64)
+    sent = received = 0
+    start = time.monotonic()
+    while received < FLOOD_FRAMES:
+        while sent < FLOOD_FRAMES and sent - received < FLOOD_WINDOW:
+            sock.send(echo(2, sent, payload))
+            sent += 1
+        receive(echo_reply)
+        received += 1
+    elapsed = time.monotonic() - start
+    print('flood: %d echoes in %.2f s, %.0f frames/s each way' % (FLOOD_FRAMES, elapsed, FLOOD_FRAMES / elapsed))
+
+
+check_arp()
+check_ping()
+check_packet_ends()
+check_dhcp()
+check_dns()
+flood()
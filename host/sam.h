@@ -0,0 +1,36 @@
+#ifndef _SAM_H_
+#define _SAM_H_
+
+/*
+  host/ stand-in for the CMSIS device header, for the firmware sources that
+  only use its core intrinsics: the bridge is one thread and takes no
+  interrupts, so there is nothing to mask or order
+*/
+#include <stdint.h>
+
+/* the SAMD21J18A's SRAM, which membudget.c holds the build to */
+#define HMCRAMC0_SIZE  0x00008000UL
+
+static inline uint32_t __get_PRIMASK(void)
+{
+  return 0;
+}
+
+static inline void __set_PRIMASK(uint32_t primask)
+{
+  (void)primask;
+}
+
+static inline void __disable_irq(void)
+{
+}
+
+static inline void __enable_irq(void)
+{
+}
+
+static inline void __DMB(void)
+{
+}
+
+#endif /* _SAM_H_ */
@@ -0,0 +1,66 @@
+#define _POSIX_C_SOURCE 200809L /* clock_gettime() */
+#include <stdint.h>
+#include <time.h>
+#include "lwip/sys.h"
+#include "time.h"
+#include "usb_host.h"
+
+/*
+  project/time.c for the host: the monotonic clock replaces SysTick, and
+  time_cycles() counts nanoseconds, so LWIP_PERF's figures come out in ns
+*/
+static struct timespec time_start;
+
+time_duty_t time_duty;
+uint32_t time_link[TIME_LINK_PHASES];
+
+static uint64_t time_ns(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)(now.tv_sec - time_start.tv_sec) * 1000000000u + now.tv_nsec - time_start.tv_nsec;
+}
+
+void time_init(void)
+{
+  clock_gettime(CLOCK_MONOTONIC, &time_start);
+}
+
+/* from 1 ms, as a time_link[] entry of 0 means not reached */
+uint32_t sys_now()
+{
+  return time_ns() / 1000000u + 1;
+}
+
+uint32_t time_cycles(void)
+{
+  return (uint32_t)time_ns();
+}
+
+/* a USB reset starts a new trace; every other milestone keeps its first timestamp */
+void time_link_mark(time_link_t phase)
+{
+  if (TIME_LINK_USB_RESET == phase)
+  {
+    for (int i = 0; i < TIME_LINK_PHASES; i++)
+      time_link[i] = 0;
+  }
+
+  if (!time_link[phase])
+    time_link[phase] = sys_now();
+}
+
+/* returns once the bridge has something for the device, or after ms */
+void time_sleep(uint32_t ms)
+{
+  uint32_t start = sys_now();
+
+  if (0 == ms)
+    return;
+
+  usb_host_wait(ms);
+
+  time_duty.sleep += sys_now() - start;
+  time_duty.wakeups++;
+}
@@ -0,0 +1,252 @@
+/*- Includes ----------------------------------------------------------------*/
+#include <stdbool.h>
+#include <string.h>
+#include "utils.h"
+#include "usb.h"
+#include "usb_std.h"
+#include "usb_descriptors.h"
+#include "usb_host.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define USB_HOST_BANKS  2 // transfers an endpoint can have armed, as with USB_DUAL_BANK_ENDPOINTS
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  uint8_t   *data[USB_HOST_BANKS];
+  int       size[USB_HOST_BANKS];
+  unsigned  head, tail;
+  bool      configured;
+  bool      stalled;
+} usb_host_ep_t;
+
+/*- Variables ---------------------------------------------------------------*/
+static usb_host_ep_t usb_host_ep[USB_EP_NUM][2]; // [ep][1] is the IN direction
+
+// the control transfer in progress
+static uint8_t *usb_host_ctrl_data;
+static int usb_host_ctrl_length;
+static int usb_host_ctrl_in_size;
+static bool usb_host_ctrl_stalled;
+static void (*usb_host_ctrl_recv)(uint8_t *data, int size);
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static usb_host_ep_t *usb_host_endpoint(int ep, int dir)
+{
+  return &usb_host_ep[ep & USB_INDEX_MASK][(USB_IN_ENDPOINT == dir) ? 1 : 0];
+}
+
+//-----------------------------------------------------------------------------
+void usb_hw_init(void)
+{
+  memset(usb_host_ep, 0, sizeof(usb_host_ep));
+}
+
+//-----------------------------------------------------------------------------
+void usb_attach(void)
+{
+}
+
+//-----------------------------------------------------------------------------
+void usb_detach(void)
+{
+}
+
+//-----------------------------------------------------------------------------
+void usb_reset_endpoint(int ep, int dir)
+{
+  usb_host_ep_t *e = usb_host_endpoint(ep, dir);
+
+  // whatever was armed is abandoned, as when the controller disables the endpoint
+  e->head = e->tail = 0;
+  e->configured = false;
+  e->stalled = false;
+}
+
+//-----------------------------------------------------------------------------
+void usb_configure_endpoint(usb_endpoint_descriptor_t *desc)
+{
+  int ep = desc->bEndpointAddress & USB_INDEX_MASK;
+  int dir = desc->bEndpointAddress & USB_DIRECTION_MASK;
+
+  usb_reset_endpoint(ep, dir);
+  usb_host_endpoint(ep, dir)->configured = true;
+}
+
+//-----------------------------------------------------------------------------
+bool usb_endpoint_configured(int ep, int dir)
+{
+  return usb_host_endpoint(ep, dir)->configured;
+}
+
+//-----------------------------------------------------------------------------
+int usb_endpoint_get_status(int ep, int dir)
+{
+  return usb_host_endpoint(ep, dir)->stalled;
+}
+
+//-----------------------------------------------------------------------------
+void usb_endpoint_set_feature(int ep, int dir)
+{
+  usb_host_endpoint(ep, dir)->stalled = true;
+}
+
+//-----------------------------------------------------------------------------
+void usb_endpoint_clear_feature(int ep, int dir)
+{
+  usb_host_endpoint(ep, dir)->stalled = false;
+}
+
+//-----------------------------------------------------------------------------
+void usb_set_address(int address)
+{
+  (void)address;
+}
+
+//-----------------------------------------------------------------------------
+static void usb_host_arm(usb_host_ep_t *e, uint8_t *data, int size)
+{
+  // the controller has no third bank either
+  if (e->head - e->tail >= USB_HOST_BANKS)
+    while (1);
+
+  e->data[e->head % USB_HOST_BANKS] = data;
+  e->size[e->head % USB_HOST_BANKS] = size;
+  e->head++;
+}
+
+//-----------------------------------------------------------------------------
+void usb_send(int ep, uint8_t *data, int size)
+{
+  usb_host_arm(usb_host_endpoint(ep, USB_IN_ENDPOINT), data, size);
+}
+
+//-----------------------------------------------------------------------------
+void usb_recv(int ep, uint8_t *data, int size)
+{
+  usb_host_arm(usb_host_endpoint(ep, USB_OUT_ENDPOINT), data, size);
+}
+
+//-----------------------------------------------------------------------------
+void usb_control_send_zlp(void)
+{
+  usb_host_ctrl_in_size = 0;
+}
+
+//-----------------------------------------------------------------------------
+void usb_control_stall(void)
+{
+  usb_host_ctrl_stalled = true;
+}
+
+//-----------------------------------------------------------------------------
+void usb_control_send(uint8_t *data, int size)
+{
+  usb_host_ctrl_in_size = LIMIT(size, usb_host_ctrl_length);
+  memcpy(usb_host_ctrl_data, data, usb_host_ctrl_in_size);
+}
+
+//-----------------------------------------------------------------------------
+void usb_control_recv(void (*callback)(uint8_t *data, int size))
+{
+  usb_host_ctrl_recv = callback;
+}
+
+//-----------------------------------------------------------------------------
+void usb_post_configuration(int config)
+{
+  usb_configuration_callback(config);
+}
+
+//-----------------------------------------------------------------------------
+void usb_post_interface(int interface, int alt)
+{
+  usb_interface_callback(interface, alt);
+}
+
+//-----------------------------------------------------------------------------
+void usb_task(void)
+{
+  usb_host_task();
+}
+
+//-----------------------------------------------------------------------------
+bool usb_task_pending(void)
+{
+  return usb_host_pending();
+}
+
+//-----------------------------------------------------------------------------
+void usb_host_reset(void)
+{
+  for (int i = 1; i < USB_EP_NUM; i++)
+  {
+    usb_reset_endpoint(i, USB_IN_ENDPOINT);
+    usb_reset_endpoint(i, USB_OUT_ENDPOINT);
+  }
+
+  usb_reset_callback();
+}
+
+//-----------------------------------------------------------------------------
+bool usb_host_control(usb_request_t *request, uint8_t *data, int *size)
+{
+  void (*callback)(uint8_t *data, int size);
+
+  // usb.c stalls what would not fit usb_ctrl_out_buf
+  if (!(request->bmRequestType & USB_IN_ENDPOINT) && request->wLength > USB_CTRL_OUT_SIZE)
+    return false;
+
+  usb_host_ctrl_data = data;
+  usb_host_ctrl_length = request->wLength;
+  usb_host_ctrl_in_size = 0;
+  usb_host_ctrl_stalled = false;
+  usb_host_ctrl_recv = NULL;
+
+  if (!usb_handle_standard_request(request) || usb_host_ctrl_stalled)
+    return false;
+
+  // the data stage of an OUT request, then its status stage
+  if (usb_host_ctrl_recv)
+  {
+    callback = usb_host_ctrl_recv;
+    usb_host_ctrl_recv = NULL;
+    callback(data, request->wLength);
+  }
+
+  *size = usb_host_ctrl_in_size;
+  return !usb_host_ctrl_stalled;
+}
+
+//-----------------------------------------------------------------------------
+bool usb_host_ready(int ep)
+{
+  usb_host_ep_t *e = usb_host_endpoint(ep, ep & USB_DIRECTION_MASK);
+
+  return e->configured && (e->head != e->tail);
+}
+
+//-----------------------------------------------------------------------------
+void usb_host_out(int ep, const uint8_t *data, int size)
+{
+  usb_host_ep_t *e = usb_host_endpoint(ep, USB_OUT_ENDPOINT);
+  int bank = e->tail++ % USB_HOST_BANKS;
+
+  memcpy(e->data[bank], data, LIMIT(size, e->size[bank]));
+  usb_recv_callback(ep & USB_INDEX_MASK, LIMIT(size, e->size[bank]));
+}
+
+//-----------------------------------------------------------------------------
+int usb_host_in(int ep, uint8_t *data, int size)
+{
+  usb_host_ep_t *e = usb_host_endpoint(ep, USB_IN_ENDPOINT);
+  int bank = e->tail++ % USB_HOST_BANKS;
+
+  size = LIMIT(e->size[bank], size);
+  memcpy(data, e->data[bank], size);
+  usb_send_callback(ep & USB_INDEX_MASK);
+
+  return size;
+}
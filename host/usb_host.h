@@ -0,0 +1,35 @@
+#ifndef _USB_HOST_H_
+#define _USB_HOST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "usb_std.h"
+
+/*
+  usb_host.c takes the place of usb/usb.c: the device side of usb.h behaves
+  as it does on the SAMD21, and the calls below play the USB host against it.
+  Each completes a transfer at once and runs the device's callback before
+  returning, the way usb_task() runs them in USB_IRQ_MODE.
+*/
+
+/* bus reset: every endpoint but EP0 is disabled, then usb_reset_callback() */
+void usb_host_reset(void);
+
+/* a control transfer; data holds wLength bytes either way, size is set to the IN stage's length */
+bool usb_host_control(usb_request_t *request, uint8_t *data, int *size);
+
+/* whether the device has a transfer armed on an endpoint (ep with its USB_IN_ENDPOINT bit) */
+bool usb_host_ready(int ep);
+
+/* complete the armed OUT transfer with size bytes, which must fit it */
+void usb_host_out(int ep, const uint8_t *data, int size);
+
+/* complete the armed IN transfer, copying at most size bytes; returns its length */
+int usb_host_in(int ep, uint8_t *data, int size);
+
+/* bridge.c: the host's side, polled by usb_task() and waited on by time_sleep() */
+void usb_host_task(void);
+bool usb_host_pending(void);
+void usb_host_wait(uint32_t ms);
+
+#endif /* _USB_HOST_H_ */
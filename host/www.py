@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+# time the www/ files over a TAP bridge: run "rndis_bridge tap0" as root, bring tap0 up with 192.168.7.2/24, then
+# "python3 www.py [fetches]"; prints the mean time and rate of each file
+
+import socket
+import sys
+import time
+
+DEVICE = '192.168.7.1'
+FILES = ['index.html', '404.html', 'state.shtml', 'img/toaster.svg', 'zepto.min.js']
+FETCHES = int(sys.argv[1]) if len(sys.argv) > 1 else 20
+
+
+def get(path):
+    sock = socket.create_connection((DEVICE, 80), timeout=10)
+    sock.sendall(b'GET /' + path.encode() + b' HTTP/1.0\r\n\r\n')
+    data = b''
+    while True:
+        chunk = sock.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+    sock.close()
+    return data
+
+
+failed = 0
+for path in FILES:
+    expected = b'HTTP/1.0 404' if path == '404.html' else b'HTTP/1.0 200'
+    ok = size = 0
+    start = time.monotonic()
+    for _ in range(FETCHES):
+        data = get(path)
+        ok += data.startswith(expected)
+        size = len(data)
+    elapsed = (time.monotonic() - start) / FETCHES
+    failed += FETCHES - ok
+    print('%-16s %6d bytes on the wire  %3d/%d OK  %7.2f ms  %6.0f KB/s' % (path, size, ok, FETCHES, elapsed * 1000, size / elapsed / 1024))
+
+sys.exit(1 if failed else 0)
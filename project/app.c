@@ -38,8 +38,10 @@
 #include <stdbool.h>
 #include <stdalign.h>
 #include <string.h>
+#if !HOST_BRIDGE
 #include "hal_gpio.h"
 #include "nvm_data.h"
+#endif
 #include "usb.h"
 #include "dhserver.h"
 #include "dnserver.h"
@@ -57,16 +59,26 @@
 #include "lwip/tcp.h"
 #include "lwip/sys.h"
 #include "lwip/timeouts.h"
+#include "lwip/stats.h"
+#include "lwip/priv/tcp_priv.h"
 #include "time.h"
 #include "httpd.h"
+#include "fs.h"
 #include "rndis.h"
+#include "usb_ncm.h"
 
 static struct netif netif_data;
-static const uint8_t hwaddr[6]  = {0x20,0x89,0x84,0x6A,0x96,0x00};
+static const uint8_t hwaddr[6]  = { RNDIS_DEVICE_HWADDR };
 static const ip_addr_t ipaddr  = IPADDR4_INIT_BYTES(192, 168, 7, 1);
 static const ip_addr_t netmask = IPADDR4_INIT_BYTES(255, 255, 255, 0);
 static const ip_addr_t gateway = IPADDR4_INIT_BYTES(0, 0, 0, 0);
-static struct pbuf *received_frame;
+
+/* frames received from USB awaiting lwIP, so the OUT endpoint can be re-armed immediately (power of two) */
+#ifndef RX_QUEUE_LEN
+#define RX_QUEUE_LEN 4
+#endif
+static struct pbuf *received_frames[RX_QUEUE_LEN];
+static volatile unsigned rx_queue_head, rx_queue_tail;
 
 static dhcp_entry_t entries[] =
 {
@@ -76,6 +88,11 @@ static dhcp_entry_t entries[] =
     { {0}, IPADDR4_INIT_BYTES(192, 168, 7, 4), 24 * 60 * 60 },
 };
 
+static void dhcp_notify(int type)
+{
+  time_link_mark((DHCP_ACK == type) ? TIME_LINK_DHCP_ACK : TIME_LINK_DHCP_OFFER);
+}
+
 static const dhcp_config_t dhcp_config =
 {
     .router = IPADDR4_INIT_BYTES(0, 0, 0, 0),  /* router address (if any) */
@@ -83,11 +100,16 @@ static const dhcp_config_t dhcp_config =
     .dns = IPADDR4_INIT_BYTES(192, 168, 7, 1), /* dns server (if any) */
     "sam",                                     /* dns suffix */
     ARRAY_SIZE(entries),                       /* num entry */
-    entries                                    /* entries */
+    entries,                                   /* entries */
+    .notify = dhcp_notify                      /* time-to-link trace */
 };
 
 static void device_init(void)
 {
+#if HOST_BRIDGE
+  /* host/: no clocks to set up and no chip serial number */
+  strcpy(usb_serial_number, "00000000");
+#else
   uint32_t sn = 0;
 
 #if 1
@@ -167,20 +189,62 @@ static void device_init(void)
     usb_serial_number[i] = "0123456789ABCDEF"[(sn >> (i * 4)) & 0xf];
 
   usb_serial_number[9] = 0;
+#endif
 
   time_init();
 }
 
-void usb_rndis_recv_callback(const uint8_t *data, int size)
+bool usb_eth_recv_callback(struct pbuf *p)
 {
-  if (received_frame)
-    return;
+  unsigned depth = rx_queue_head - rx_queue_tail;
 
-  received_frame = pbuf_alloc(PBUF_RAW, size, PBUF_POOL);
-  if (!received_frame) 
-    return;
+  if (depth >= RX_QUEUE_LEN)
+    return false;
+
+  received_frames[rx_queue_head & (RX_QUEUE_LEN - 1)] = p;
+  rx_queue_head++;
 
-  memcpy(received_frame->payload, data, size);
+  if (++depth > usb_eth_stat.rxqueuemax)
+    usb_eth_stat.rxqueuemax = depth;
+
+  return true;
+}
+
+bool usb_eth_recv_full(void)
+{
+  return (rx_queue_head - rx_queue_tail) >= RX_QUEUE_LEN;
+}
+
+/* lwIP stops checking what the host no longer computes; ICMP is never offloaded */
+void usb_eth_checksum_callback(uint32_t offloaded)
+{
+  u16_t flags = NETIF_CHECKSUM_ENABLE_ALL;
+
+  if (offloaded & NDIS_TASK_CHECKSUM_IP)
+    flags &= ~NETIF_CHECKSUM_CHECK_IP;
+  if (offloaded & NDIS_TASK_CHECKSUM_UDP)
+    flags &= ~NETIF_CHECKSUM_CHECK_UDP;
+  if (offloaded & NDIS_TASK_CHECKSUM_TCP)
+    flags &= ~NETIF_CHECKSUM_CHECK_TCP;
+
+  NETIF_SET_CHECKSUM_CTRL(&netif_data, flags);
+}
+
+int usb_eth_xmit_copy(struct pbuf *p, void *buffer, int size)
+{
+  struct pbuf *q;
+  int left = size;
+
+  for (q = p; q && (left > 0); q = q->next)
+  {
+    if (PBUF_ROM == q->type_internal)
+      usb_eth_stat.txcopied_rom += LWIP_MIN(q->len, left);
+    left -= q->len;
+  }
+
+  size = pbuf_copy_partial(p, buffer, size, 0);
+  usb_eth_stat.txcopied += size;
+  return size;
 }
 
 err_t output_fn(struct netif *netif, struct pbuf *p, const ip_addr_t *ipaddr)
@@ -190,25 +254,40 @@ err_t output_fn(struct netif *netif, struct pbuf *p, const ip_addr_t *ipaddr)
 
 err_t linkoutput_fn(struct netif *netif, struct pbuf *p)
 {
-    for (;;)
-    {
-        if (usb_rndis_can_xmit()) goto ok_to_xmit;
-        usb_task();
-    }
-
-    return ERR_USE;
-
-ok_to_xmit:
-    rndis_send(p);
+    /* queued by reference; ERR_MEM once the queue is full makes TCP back off */
+#if USB_NCM
+    return usb_ncm_xmit_packet(p);
+#else
+    return rndis_send(p);
+#endif
+}
 
+/* groups lwIP joins become the RX filter's multicast list (IPv4 group -> 01:00:5E MAC) */
+static err_t igmp_mac_filter_fn(struct netif *netif, const ip4_addr_t *group, enum netif_mac_filter_action action)
+{
+    const uint8_t addr[6] = { 0x01, 0x00, 0x5E, ip4_addr2(group) & 0x7F, ip4_addr3(group), ip4_addr4(group) };
+
+    (void)netif;
+#if USB_NCM
+    /*
+      NCM advertises wNumberMCFilters 0, so there is no multicast list either
+      way: the host's groups all pass usb_ncm_packet_filter(), and frames for
+      groups lwIP has not joined take a pool pbuf until ip4_input() drops them
+    */
+    (void)addr;
+    (void)action;
     return ERR_OK;
+#else
+    return rndis_multicast_filter(addr, NETIF_ADD_MAC_FILTER == action) ? ERR_OK : ERR_MEM;
+#endif
 }
 
 err_t netif_init_cb(struct netif *netif)
 {
     LWIP_ASSERT("netif != NULL", (netif != NULL));
     netif->mtu = RNDIS_MTU;
-    netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP | NETIF_FLAG_UP;
+    netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP | NETIF_FLAG_UP | NETIF_FLAG_IGMP;
+    netif_set_igmp_mac_filter(netif, igmp_mac_filter_fn);
     netif->state = NULL;
     netif->name[0] = 'E';
     netif->name[1] = 'X';
@@ -233,7 +312,11 @@ static void init_periph(void)
 {
   device_init();
   usb_init();
+#if USB_NCM
+  usb_ncm_init();
+#else
   usb_rndis_init();
+#endif
 }
 
 bool dns_query_proc(const char *name, ip_addr_t *addr)
@@ -282,7 +365,7 @@ static const tCGI cgi_uri_table[] =
     { "/ctl.cgi",   ctl_cgi_handler },
 };
 
-static u16_t ssi_handler(int index, char *insert, int ins_len)
+static u16_t ssi_handler(int index, char *insert, int ins_len, void *connection_state)
 {
     int res;
 
@@ -310,30 +393,144 @@ static u16_t ssi_handler(int index, char *insert, int ins_len)
     return res;
 }
 
+/*
+  httpd sends file data by reference to flash, so each byte should be copied
+  once, into the IN endpoint's buffer: usb_eth_stat.txcopied_rom / file_bytes
+  is the copies per byte served (above 1 only for retransmissions)
+*/
+http_stat_t http_stat;
+
+/* a file's state: lwIP's own stats are left alone, and each request keeps its baseline and peak here */
+typedef struct {
+  bool open;
+  uint32_t ram_base; /* http_ram() when the file was opened */
+  uint32_t ram_peak; /* the most http_ram() seen since */
+} http_file_t;
+
+/* one open file per connection at most */
+static http_file_t http_files[MEMP_NUM_TCP_PCB];
+static unsigned http_open;
+
+/* lwIP RAM in use that a request adds to: heap, TCP segments and PBUF_ROM references */
+static uint32_t http_ram(void)
+{
+  return lwip_stats.mem.used +
+    lwip_stats.memp[MEMP_TCP_SEG]->used * sizeof(struct tcp_seg) +
+    lwip_stats.memp[MEMP_PBUF]->used * sizeof(struct pbuf);
+}
+
+/* called after everything that can enqueue data: after each frame, and after the timers (httpd's poll) */
+static void http_sample(void)
+{
+  uint32_t ram;
+
+  if (!http_open)
+    return;
+
+  ram = http_ram();
+  for (unsigned i = 0; i < ARRAY_SIZE(http_files); i++)
+  {
+    if (http_files[i].open && (ram > http_files[i].ram_peak))
+      http_files[i].ram_peak = ram;
+  }
+}
+
+void *fs_state_init(struct fs_file *file, const char *name)
+{
+  http_stat.requests++;
+  http_stat.file_bytes += file->len;
+
+  for (unsigned i = 0; i < ARRAY_SIZE(http_files); i++)
+  {
+    if (!http_files[i].open)
+    {
+      http_files[i].open = true;
+      http_files[i].ram_base = http_files[i].ram_peak = http_ram();
+      http_open++;
+      return &http_files[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* httpd closes the file once the last of it is enqueued; overlapping requests each count the other's RAM too */
+void fs_state_free(struct fs_file *file, void *state)
+{
+  http_file_t *f = state;
+
+  if (!f)
+    return;
+
+  http_sample();
+  http_stat.ram_last = f->ram_peak - f->ram_base;
+  if (http_stat.ram_last > http_stat.ram_max)
+    http_stat.ram_max = http_stat.ram_last;
+
+  f->open = false;
+  http_open--;
+}
+
 static void service_traffic(void)
 {
-  if (received_frame)
+  while (rx_queue_tail != rx_queue_head)
   {
-    ethernet_input(received_frame, &netif_data);
-    pbuf_free(received_frame);
-    received_frame = NULL;
-    usb_rndis_recv_renew();
+    PERF_START;
+
+    /* ethernet_input() takes ownership of the pbuf */
+    ethernet_input(received_frames[rx_queue_tail & (RX_QUEUE_LEN - 1)], &netif_data);
+    rx_queue_tail++;
+    http_sample();
+
+    PERF_STOP("ethernet_input");
   }
 
   sys_check_timeouts();
+  http_sample();
+
+  /* also retries arming the OUT endpoint should the pbuf pool have been empty */
+#if USB_NCM
+  usb_ncm_recv_renew();
+#else
+  usb_rndis_recv_renew();
+#endif
+}
+
+/* sleep until the USB interrupt or the next lwIP timeout; polling builds never sleep */
+static void idle(void)
+{
+#if USB_IRQ_MODE
+  __disable_irq();
+  if (!usb_task_pending() && (rx_queue_tail == rx_queue_head))
+    time_sleep(sys_timeouts_sleeptime());
+  __enable_irq();
+#endif
 }
 
+#if HOST_BRIDGE
+/* host/bridge.c has main(): it parses the command line, then runs the firmware */
+int app_main(void)
+#else
 int main(void)
+#endif
 {
+  err_t err;
+
   init_periph();
 
   init_lwip();
 
-  while (!netif_is_up(&netif_data));
-
-  while (dhserv_init(&dhcp_config) != ERR_OK);
+  /*
+    the netif is added up, and the servers only fail when lwIP is out of PCBs, which retrying would not cure;
+    trap there for the debugger (LWIP_ASSERT cannot: cc.h's LWIP_PLATFORM_ASSERT is handed only the message)
+  */
+  err = dhserv_init(&dhcp_config);
+  if (ERR_OK != err)
+    while (1);
 
-  while (dnserv_init(&ipaddr, 53, dns_query_proc) != ERR_OK);
+  err = dnserv_init(&ipaddr, 53, dns_query_proc);
+  if (ERR_OK != err)
+    while (1);
 
   http_set_cgi_handlers(cgi_uri_table, sizeof(cgi_uri_table) / sizeof(tCGI));
   http_set_ssi_handler(ssi_handler, ssi_tags_table, sizeof(ssi_tags_table) / sizeof(char *));
@@ -343,17 +540,21 @@ int main(void)
   {
     usb_task();
     service_traffic();
+    idle();
   }
 
   return 0;
 }
 
-/* lwip has provision for using a mutex, when applicable */
+/* lwip has provision for using a mutex, when applicable; here that means masking interrupts */
 sys_prot_t sys_arch_protect(void)
 {
-  return 0;
+  sys_prot_t primask = __get_PRIMASK();
+
+  __disable_irq();
+  return primask;
 }
 void sys_arch_unprotect(sys_prot_t pval)
 {
-  (void)pval;
+  __set_PRIMASK(pval);
 }
@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <sam.h>
+#include "lwip/opt.h"
+#include "lwip/memp.h"
+
+/* everything memp_std.h takes the size of, as in memp.c */
+#include "lwip/pbuf.h"
+#include "lwip/raw.h"
+#include "lwip/udp.h"
+#include "lwip/tcp.h"
+#include "lwip/priv/tcp_priv.h"
+#include "lwip/altcp.h"
+#include "lwip/ip4_frag.h"
+#include "lwip/netbuf.h"
+#include "lwip/api.h"
+#include "lwip/priv/tcpip_priv.h"
+#include "lwip/priv/api_msg.h"
+#include "lwip/priv/sockets_priv.h"
+#include "lwip/etharp.h"
+#include "lwip/igmp.h"
+#include "lwip/timeouts.h"
+#include "netif/ppp/ppp_opts.h"
+#include "lwip/netdb.h"
+#include "lwip/dns.h"
+#include "lwip/priv/nd6_priv.h"
+#include "lwip/ip6_frag.h"
+#include "lwip/mld6.h"
+
+#include "usb.h"
+#include "usb_std.h"
+#include "usb_descriptors.h"
+#include "usb_rndis.h"
+#include "usb_ncm.h"
+#include "rndis.h"
+#include "dhserver.h"
+
+/*
+  Static RAM budget: the stack, the heap, the large buffers of each module and
+  every lwIP pool, sized with the same macros that declare them, so that a
+  LWIP_PROFILE (lwipopts.h) or a queue length that cannot fit the part fails
+  to compile rather than to link. Smaller statics (lwIP's internal tables,
+  netif and USB state, queues of pointers, statistics) are not listed; the
+  linker still catches those, and the map file accounts for them.
+  mem_budget[] is the report: read it with the debugger, or from the map file.
+*/
+
+/* the .hzp passes the linker's stack and heap sizes ($(StackSize), $(HeapSize)) here too */
+#ifndef MEM_BUDGET_STACK
+#error "MEM_BUDGET_STACK must be the linker stack size"
+#endif
+
+#ifndef MEM_BUDGET_HEAP
+#error "MEM_BUDGET_HEAP must be the linker heap size"
+#endif
+
+/* one lwIP pool, as LWIP_MEMPOOL_DECLARE() lays it out */
+#define MEM_BUDGET_POOL(num, size)  ((num) * (MEMP_SIZE + MEMP_ALIGN_SIZE(size)))
+
+/* lwIP's heap and its two struct mem (8 bytes each) marking the ends */
+#define MEM_BUDGET_LWIP_HEAP  (LWIP_MEM_ALIGN_SIZE(MEM_SIZE) + 2 * 8)
+
+#if USB_NCM
+#define MEM_BUDGET_USB(X) \
+  X("usb_ncm.c transmitted", USB_NCM_TX_BANKS * USB_NCM_NTB_IN_SIZE) \
+  X("usb_ncm.c received", USB_NCM_RX_BANKS * USB_NCM_NTB_OUT_SIZE)
+#else
+#define MEM_BUDGET_USB(X) \
+  X("usb_rndis.c transmitted", USB_RNDIS_TX_BANKS * RNDIS_BUFFER_SIZE) \
+  X("rndis.c rndis_responses", RNDIS_RESPONSE_QUEUE_LEN * RNDIS_RESPONSE_SIZE)
+#endif
+
+#define MEM_BUDGET_STATIC(X) \
+  MEM_BUDGET_USB(X) \
+  X("usb.c usb_ctrl_out_buf", USB_CTRL_OUT_SIZE) \
+  X("usb.c usb_ctrl_in_buf", 64) \
+  X("dhserver.c dhcp_data", DHCP_PACKET_SIZE) \
+  X("lwIP heap (MEM_SIZE)", MEM_BUDGET_LWIP_HEAP) \
+  X("stack", MEM_BUDGET_STACK) \
+  X("heap", MEM_BUDGET_HEAP)
+
+enum
+{
+  MEM_BUDGET_TOTAL = 0
+#define MEM_BUDGET_SUM(name, size) + (size)
+  MEM_BUDGET_STATIC(MEM_BUDGET_SUM)
+#define LWIP_MEMPOOL(name, num, size, desc) + MEM_BUDGET_POOL(num, size)
+#include "lwip/priv/memp_std.h"
+};
+
+_Static_assert(MEM_BUDGET_TOTAL <= HMCRAMC0_SIZE, "listed RAM exceeds the part: choose a smaller LWIP_PROFILE or shorten the queues");
+
+/* each segment in flight holds a header pbuf from the heap; leave the rest for ARP, ICMP and copied data */
+#define MEM_BUDGET_SND_HDR  (LWIP_MEM_ALIGN_SIZE(sizeof(struct pbuf)) + \
+  LWIP_MEM_ALIGN_SIZE(PBUF_LINK_ENCAPSULATION_HLEN + PBUF_LINK_HLEN + PBUF_IP_HLEN + PBUF_TRANSPORT_HLEN) + 8)
+
+_Static_assert(TCP_SND_SEGS * MEM_BUDGET_SND_HDR <= MEM_SIZE / 2, "TCP_SND_SEGS headers would crowd out the lwIP heap");
+
+typedef struct
+{
+  const char *name;
+  uint32_t size;
+} mem_budget_t;
+
+const mem_budget_t mem_budget[] =
+{
+#define MEM_BUDGET_ENTRY(name, size) { name, size },
+  MEM_BUDGET_STATIC(MEM_BUDGET_ENTRY)
+#define LWIP_MEMPOOL(name, num, size, desc) { "lwIP " desc, MEM_BUDGET_POOL(num, size) },
+#include "lwip/priv/memp_std.h"
+};
+
+/* headroom left by the budget, for growing a profile */
+const uint32_t mem_budget_free = HMCRAMC0_SIZE - MEM_BUDGET_TOTAL;
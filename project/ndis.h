@@ -52,6 +52,21 @@
 #define OID_PNP_REMOVE_WAKE_UP_PATTERN          0xFD010104
 #define OID_PNP_ENABLE_WAKE_UP                  0xFD010106
 
+/* NDIS 5 task offload, from ntddndis.h */
+#define OID_TCP_TASK_OFFLOAD                    0xFC010201
+
+#define NDIS_TASK_OFFLOAD_VERSION               1
+#define NDIS_TASK_OFFLOAD_SIZE                  24 /* sizeof(NDIS_TASK_OFFLOAD): TaskBuffer[1] pads it */
+#define NDIS_ENCAPSULATION_IEEE_802_3           2
+#define NDIS_TASK_TCP_IP_CHECKSUM               0
+
+/* bit-fields of each NDIS_TASK_TCP_IP_CHECKSUM member (V4Transmit, V4Receive, ...) */
+#define NDIS_TASK_CHECKSUM_IP_OPTIONS           0x01
+#define NDIS_TASK_CHECKSUM_TCP_OPTIONS          0x02
+#define NDIS_TASK_CHECKSUM_TCP                  0x04
+#define NDIS_TASK_CHECKSUM_UDP                  0x08
+#define NDIS_TASK_CHECKSUM_IP                   0x10
+
 enum NDIS_DEVICE_POWER_STATE {
 	NdisDeviceStateUnspecified = 0,
 	NdisDeviceStateD0,
@@ -28,243 +28,781 @@
  */
 
 #include <stdalign.h>
+#include <stddef.h>
 #include <string.h>
+#include <ctype.h>
 #include "rndis_protocol.h"
+#include "usb.h"
 #include "usb_rndis.h"
 #include "rndis.h"
+#include "time.h"
+#include "lwip/sys.h"
+
+#if !USB_NCM
 
 static const uint8_t station_hwaddr[6] = { RNDIS_HWADDR };
 static const uint8_t permanent_hwaddr[6] = { RNDIS_HWADDR };
+static const uint8_t device_hwaddr[6] = { RNDIS_DEVICE_HWADDR };
+static const uint8_t broadcast_hwaddr[6] = { 0xFF,0xFF,0xFF,0xFF,0xFF,0xFF };
+
+/* multicast MAC-address list fronted by a 64-bit hash of the addresses' CRC, so most misses cost one bit test */
+typedef struct
+{
+  uint32_t hash[2];
+  int count;
+  uint8_t addr[RNDIS_MULTICAST_MAX][6];
+} rndis_multicast_t;
+
+static rndis_multicast_t rx_multicast;   /* groups the device's own stack joined (via igmp_mac_filter) */
+static rndis_multicast_t host_multicast; /* groups the host asked for with OID_802_3_MULTICAST_LIST */
 
-static usb_eth_stat_t usb_eth_stat = { 0, 0, 0, 0 };
+usb_eth_stat_t usb_eth_stat;
 static uint32_t oid_packet_filter = 0x0000000;
+static uint32_t checksum_offloaded; /* NDIS_TASK_CHECKSUM_* the host set with OID_TCP_TASK_OFFLOAD */
 static rndis_state_t rndis_state;
 
 /* data handed to USB peripheral must be 32-bit aligned and in RAM */
 static alignas(4) uint8_t ndis_report[8] = { 0x01,0x00,0x00,0x00,0x00,0x00,0x00,0x00 };
 
-static const uint32_t OIDSupportedList[] = 
-{
-    OID_GEN_SUPPORTED_LIST,
-    OID_GEN_HARDWARE_STATUS,
-    OID_GEN_MEDIA_SUPPORTED,
-    OID_GEN_MEDIA_IN_USE,
-    OID_GEN_MAXIMUM_FRAME_SIZE,
-    OID_GEN_LINK_SPEED,
-    OID_GEN_TRANSMIT_BLOCK_SIZE,
-    OID_GEN_RECEIVE_BLOCK_SIZE,
-    OID_GEN_VENDOR_ID,
-    OID_GEN_VENDOR_DESCRIPTION,
-    OID_GEN_VENDOR_DRIVER_VERSION,
-    OID_GEN_CURRENT_PACKET_FILTER,
-    OID_GEN_MAXIMUM_TOTAL_SIZE,
-    OID_GEN_PROTOCOL_OPTIONS,
-    OID_GEN_MAC_OPTIONS,
-    OID_GEN_MEDIA_CONNECT_STATUS,
-    OID_GEN_MAXIMUM_SEND_PACKETS,
-    OID_802_3_PERMANENT_ADDRESS,
-    OID_802_3_CURRENT_ADDRESS,
-    OID_802_3_MULTICAST_LIST,
-    OID_802_3_MAXIMUM_LIST_SIZE,
-    OID_802_3_MAC_OPTIONS
+#define MAC_OPT NDIS_MAC_OPTION_COPY_LOOKAHEAD_DATA | \
+      NDIS_MAC_OPTION_RECEIVE_SERIALIZED  | \
+      NDIS_MAC_OPTION_TRANSFERS_NOT_PEND  | \
+      NDIS_MAC_OPTION_NO_LOOPBACK
+
+extern int usb_rndis_xmit_batch;
+
+/* whether a UTF-16LE parameter name is the given ASCII key; registry names ignore case */
+static bool rndis_config_key(const uint8_t *name, uint32_t len, const char *key)
+{
+  if (len != 2 * strlen(key))
+    return false;
+
+  for (; *key; key++, name += 2)
+  {
+    if (name[1] || (tolower(name[0]) != tolower(*key)))
+      return false;
+  }
+
+  return true;
+}
+
+/* numerical parameters arrive as a 32-bit value, string ones as UTF-16LE decimal digits */
+static bool rndis_config_value(const rndis_config_parameter_t *p, uint32_t *value)
+{
+  const uint8_t *v = (const uint8_t *)p + p->ParameterValueOffset;
+  uint32_t i;
+
+  if (PARAMETER_TYPE_NUMERICAL == p->ParameterType)
+  {
+    if (p->ParameterValueLength < 4)
+      return false;
+    memcpy(value, v, 4);
+    return true;
+  }
+
+  *value = 0;
+  for (i = 0; (i + 1 < p->ParameterValueLength) && (v[i] || v[i + 1]); i += 2)
+  {
+    if (v[i + 1] || !isdigit(v[i]))
+      return false;
+    *value = *value * 10 + (v[i] - '0');
+  }
+
+  return i > 0;
+}
+
+/* the host passes the driver's Advanced-tab settings; names nobody here knows are accepted and ignored */
+static void rndis_handle_config_parm(const rndis_config_parameter_t *p)
+{
+  const uint8_t *name = (const uint8_t *)p + p->ParameterNameOffset;
+  uint32_t value;
+
+  if (!rndis_config_value(p, &value))
+    return;
+
+  if (rndis_config_key(name, p->ParameterNameLength, "MaxPacketsPerTransfer"))
+    usb_rndis_xmit_batch = (value < 1) ? 1 : (value > RNDIS_MAX_PACKETS_PER_TRANSFER) ? RNDIS_MAX_PACKETS_PER_TRANSFER : value;
+}
+
+/* top six bits of the Ethernet CRC, as MAC hash filters use; nibble-wise to keep the table small */
+static int rndis_multicast_hash(const uint8_t *addr)
+{
+  static const uint32_t crc_nibble[16] =
+  {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+  };
+  uint32_t crc = 0xFFFFFFFF;
+
+  for (int i = 0; i < 6; i++)
+  {
+    crc = (crc >> 4) ^ crc_nibble[(crc ^ addr[i]) & 0x0F];
+    crc = (crc >> 4) ^ crc_nibble[(crc ^ (addr[i] >> 4)) & 0x0F];
+  }
+
+  return crc >> 26;
+}
+
+static void rndis_multicast_rehash(rndis_multicast_t *list)
+{
+  list->hash[0] = list->hash[1] = 0;
+
+  for (int i = 0; i < list->count; i++)
+  {
+    int h = rndis_multicast_hash(list->addr[i]);
+    list->hash[h >> 5] |= 1UL << (h & 31);
+  }
+}
+
+static bool rndis_multicast_match(const rndis_multicast_t *list, const uint8_t *addr)
+{
+  int h = rndis_multicast_hash(addr);
+
+  if (!(list->hash[h >> 5] & (1UL << (h & 31))))
+    return false;
+
+  for (int i = 0; i < list->count; i++)
+  {
+    if (!memcmp(addr, list->addr[i], 6))
+      return true;
+  }
+
+  return false;
+}
+
+/* add or remove a group the device itself listens to; the netif's igmp_mac_filter hook */
+bool rndis_multicast_filter(const uint8_t *addr, bool add)
+{
+  for (int i = 0; i < rx_multicast.count; i++)
+  {
+    if (memcmp(addr, rx_multicast.addr[i], 6))
+      continue;
+
+    if (!add)
+    {
+      memcpy(rx_multicast.addr[i], rx_multicast.addr[--rx_multicast.count], 6);
+      rndis_multicast_rehash(&rx_multicast);
+    }
+    return true;
+  }
+
+  if (!add)
+    return true;
+
+  if (rx_multicast.count >= RNDIS_MULTICAST_MAX)
+    return false;
+
+  memcpy(rx_multicast.addr[rx_multicast.count++], addr, 6);
+  rndis_multicast_rehash(&rx_multicast);
+  return true;
+}
+
+/* OID handlers; queries write their answer to info and return its size, sets return an RNDIS status */
+static int rndis_oid_supported_list(void *info);
+
+static int rndis_oid_multicast_list(void *info)
+{
+  memcpy(info, host_multicast.addr, 6 * host_multicast.count);
+  return 6 * host_multicast.count;
+}
+
+static uint32_t rndis_oid_set_config_parameter(const void *info, uint32_t size)
+{
+  const rndis_config_parameter_t *p = info;
+
+  if ((size < sizeof(rndis_config_parameter_t)) ||
+      (p->ParameterNameOffset > size) || (p->ParameterNameLength > size - p->ParameterNameOffset) ||
+      (p->ParameterValueOffset > size) || (p->ParameterValueLength > size - p->ParameterValueOffset))
+    return RNDIS_STATUS_INVALID_DATA;
+
+  rndis_handle_config_parm(p);
+  return RNDIS_STATUS_SUCCESS;
+}
+
+/* also takes CDC-ECM's SET_ETHERNET_PACKET_FILTER, once mapped to NDIS_PACKET_TYPE_* bits */
+void rndis_set_packet_filter(uint32_t filter)
+{
+  oid_packet_filter = filter;
+  if (oid_packet_filter)
+    time_link_mark(TIME_LINK_PACKET_FILTER);
+}
+
+static uint32_t rndis_oid_set_packet_filter(const void *info, uint32_t size)
+{
+  uint32_t filter;
+
+  if (size < 4)
+    return RNDIS_STATUS_INVALID_LENGTH;
+  memcpy(&filter, info, 4);
+  rndis_set_packet_filter(filter);
+  rndis_state = oid_packet_filter ? rndis_data_initialized : rndis_initialized;
+  return RNDIS_STATUS_SUCCESS;
+}
+
+static uint32_t rndis_oid_set_multicast_list(const void *info, uint32_t size)
+{
+  if (size % 6)
+    return RNDIS_STATUS_INVALID_DATA;
+  if (size > sizeof(host_multicast.addr))
+    return NDIS_STATUS_MULTICAST_FULL;
+
+  host_multicast.count = size / 6;
+  memcpy(host_multicast.addr, info, size);
+  rndis_multicast_rehash(&host_multicast);
+  return RNDIS_STATUS_SUCCESS;
+}
+
+static uint32_t rndis_oid_set_ignored(const void *info, uint32_t size)
+{
+  (void)info;
+  (void)size;
+  return RNDIS_STATUS_SUCCESS;
+}
+
+/* checksums the host may leave to us on IPv4 frames it sends: the USB CRC already guards them, so lwIP just skips checking */
+#define RNDIS_CHECKSUM_OFFLOAD (NDIS_TASK_CHECKSUM_IP_OPTIONS | NDIS_TASK_CHECKSUM_TCP_OPTIONS | \
+                                NDIS_TASK_CHECKSUM_TCP | NDIS_TASK_CHECKSUM_UDP | NDIS_TASK_CHECKSUM_IP)
+
+static void rndis_checksum_offload(uint32_t offloaded)
+{
+  if (offloaded != checksum_offloaded)
+  {
+    checksum_offloaded = offloaded;
+    usb_eth_checksum_callback(offloaded);
+  }
+}
+
+static int rndis_oid_task_offload(void *info)
+{
+  ndis_task_offload_header_t *hdr = info;
+  ndis_task_offload_t *task = (ndis_task_offload_t *)(hdr + 1);
+  ndis_task_tcp_ip_checksum_t *checksum = (ndis_task_tcp_ip_checksum_t *)(task + 1);
+
+  memset(info, 0, sizeof(*hdr) + sizeof(*task) + sizeof(*checksum));
+  hdr->Version = NDIS_TASK_OFFLOAD_VERSION;
+  hdr->Size = sizeof(*hdr);
+  hdr->OffsetFirstTask = sizeof(*hdr);
+  hdr->Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+  hdr->EncapsulationHeaderSize = ETH_HEADER_SIZE;
+  task->Version = NDIS_TASK_OFFLOAD_VERSION;
+  task->Size = NDIS_TASK_OFFLOAD_SIZE;
+  task->Task = NDIS_TASK_TCP_IP_CHECKSUM;
+  task->TaskBufferLength = sizeof(*checksum);
+  /*
+    V4Transmit: the host leaves the checksums of what it sends, and lwIP skips
+    checking them (usb_eth_checksum_callback). V4Receive is not offered: it
+    would only spare the host checking what this end sends, which lwIP sums
+    anyway, at 16 bytes of per-packet info in every message on the bus.
+  */
+  checksum->V4Transmit = RNDIS_CHECKSUM_OFFLOAD;
+
+  return sizeof(*hdr) + sizeof(*task) + sizeof(*checksum);
+}
+
+static uint32_t rndis_oid_set_task_offload(const void *info, uint32_t size)
+{
+  const ndis_task_offload_header_t *hdr = info;
+  uint32_t offset, offloaded = 0;
+
+  if (((uint32_t)info & 3) || (size < sizeof(*hdr)) || (hdr->Version != NDIS_TASK_OFFLOAD_VERSION))
+    return RNDIS_STATUS_INVALID_DATA;
+
+  /* each task must lie within the buffer, and the list only moves forward */
+  for (offset = hdr->OffsetFirstTask; offset; )
+  {
+    const ndis_task_offload_t *task = (const ndis_task_offload_t *)((const uint8_t *)info + offset);
+    ndis_task_tcp_ip_checksum_t checksum;
+
+    if ((offset & 3) || (offset > size) || (size - offset < sizeof(*task)) ||
+        (task->TaskBufferLength > size - offset - sizeof(*task)))
+      return RNDIS_STATUS_INVALID_DATA;
+
+    if ((NDIS_TASK_TCP_IP_CHECKSUM != task->Task) || (task->TaskBufferLength < sizeof(checksum)))
+      return RNDIS_STATUS_NOT_SUPPORTED;
+
+    memcpy(&checksum, task + 1, sizeof(checksum));
+    if (checksum.V4Receive || checksum.V6Transmit || checksum.V6Receive || (checksum.V4Transmit & ~RNDIS_CHECKSUM_OFFLOAD))
+      return RNDIS_STATUS_NOT_SUPPORTED;
+    offloaded = checksum.V4Transmit;
+
+    if (!task->OffsetNextTask)
+      break;
+    /* past this task and still inside the buffer, so a cycle or a wrap around 2^32 cannot loop forever */
+    if ((task->OffsetNextTask < sizeof(*task) + task->TaskBufferLength) || (task->OffsetNextTask > size - offset))
+      return RNDIS_STATUS_INVALID_DATA;
+    offset += task->OffsetNextTask;
+  }
+
+  rndis_checksum_offload(offloaded);
+  return RNDIS_STATUS_SUCCESS;
+}
+
+typedef struct
+{
+  rndis_Oid_t oid;
+  uint32_t size;                                    /* of the answer at data; 8 for the 64-bit counters */
+  const void *data;                                 /* answer to a query, NULL when query computes it */
+  int (*query)(void *info);
+  uint32_t (*set)(const void *info, uint32_t size); /* NULL when the OID is query-only */
+} rndis_oid_t;
+
+#define OID_VALUE(oid, value)            { oid, 4, &(const uint32_t){ value }, NULL, NULL }
+#define OID_DATA(oid, data, size, set)   { oid, size, data, NULL, set }
+#define OID_QUERY(oid, query, set)       { oid, 0, NULL, query, set }
+#define OID_COUNTER(oid, counter)        { oid, 8, &counter, NULL, NULL }
+
+/*
+  every OID the device handles, sorted by OID for the binary search in rndis_find_oid();
+  OID_GEN_SUPPORTED_LIST is generated from it, so what is advertised is exactly what is handled
+*/
+static const rndis_oid_t rndis_oids[] =
+{
+  OID_QUERY(OID_GEN_SUPPORTED_LIST,         rndis_oid_supported_list, NULL),
+  OID_VALUE(OID_GEN_HARDWARE_STATUS,        0),
+  OID_VALUE(OID_GEN_MEDIA_SUPPORTED,        NDIS_MEDIUM_802_3),
+  OID_VALUE(OID_GEN_MEDIA_IN_USE,           NDIS_MEDIUM_802_3),
+  OID_VALUE(OID_GEN_MAXIMUM_FRAME_SIZE,     ETH_MAX_PACKET_SIZE - ETH_HEADER_SIZE),
+  OID_VALUE(OID_GEN_LINK_SPEED,             RNDIS_LINK_SPEED / 100),
+  OID_VALUE(OID_GEN_TRANSMIT_BLOCK_SIZE,    ETH_MAX_PACKET_SIZE),
+  OID_VALUE(OID_GEN_RECEIVE_BLOCK_SIZE,     ETH_MAX_PACKET_SIZE),
+  OID_VALUE(OID_GEN_VENDOR_ID,              0x00FFFFFF),
+  OID_DATA (OID_GEN_VENDOR_DESCRIPTION,     RNDIS_VENDOR, sizeof(RNDIS_VENDOR), NULL),
+  OID_DATA (OID_GEN_CURRENT_PACKET_FILTER,  &oid_packet_filter, 4, rndis_oid_set_packet_filter),
+  OID_DATA (OID_GEN_CURRENT_LOOKAHEAD,      &(const uint32_t){ ETH_MAX_PACKET_SIZE - ETH_HEADER_SIZE }, 4, rndis_oid_set_ignored),
+  OID_VALUE(OID_GEN_MAXIMUM_TOTAL_SIZE,     ETH_MAX_PACKET_SIZE),
+  OID_DATA (OID_GEN_PROTOCOL_OPTIONS,       &(const uint32_t){ 0 }, 4, rndis_oid_set_ignored),
+  OID_VALUE(OID_GEN_MAC_OPTIONS,            /*MAC_OPT*/ 0),
+  OID_VALUE(OID_GEN_MEDIA_CONNECT_STATUS,   NDIS_MEDIA_STATE_CONNECTED),
+  OID_VALUE(OID_GEN_MAXIMUM_SEND_PACKETS,   RNDIS_MAX_PACKETS_PER_TRANSFER),
+  OID_VALUE(OID_GEN_VENDOR_DRIVER_VERSION,  0x00001000),
+  OID_VALUE(OID_GEN_PHYSICAL_MEDIUM,        NDIS_MEDIUM_802_3),
+  OID_DATA (OID_GEN_RNDIS_CONFIG_PARAMETER, &(const uint32_t){ 0 }, 4, rndis_oid_set_config_parameter),
+  OID_COUNTER(OID_GEN_XMIT_OK,              usb_eth_stat.txok),
+  OID_COUNTER(OID_GEN_RCV_OK,               usb_eth_stat.rxok),
+  OID_COUNTER(OID_GEN_XMIT_ERROR,           usb_eth_stat.txbad),
+  OID_COUNTER(OID_GEN_RCV_ERROR,            usb_eth_stat.rxbad),
+  OID_COUNTER(OID_GEN_RCV_NO_BUFFER,        usb_eth_stat.rxnobuf),
+  OID_COUNTER(OID_GEN_DIRECTED_BYTES_XMIT,  usb_eth_stat.tx[USB_ETH_DIRECTED].bytes),
+  OID_COUNTER(OID_GEN_DIRECTED_FRAMES_XMIT, usb_eth_stat.tx[USB_ETH_DIRECTED].frames),
+  OID_COUNTER(OID_GEN_MULTICAST_BYTES_XMIT, usb_eth_stat.tx[USB_ETH_MULTICAST].bytes),
+  OID_COUNTER(OID_GEN_MULTICAST_FRAMES_XMIT, usb_eth_stat.tx[USB_ETH_MULTICAST].frames),
+  OID_COUNTER(OID_GEN_BROADCAST_BYTES_XMIT, usb_eth_stat.tx[USB_ETH_BROADCAST].bytes),
+  OID_COUNTER(OID_GEN_BROADCAST_FRAMES_XMIT, usb_eth_stat.tx[USB_ETH_BROADCAST].frames),
+  OID_COUNTER(OID_GEN_DIRECTED_BYTES_RCV,   usb_eth_stat.rx[USB_ETH_DIRECTED].bytes),
+  OID_COUNTER(OID_GEN_DIRECTED_FRAMES_RCV,  usb_eth_stat.rx[USB_ETH_DIRECTED].frames),
+  OID_COUNTER(OID_GEN_MULTICAST_BYTES_RCV,  usb_eth_stat.rx[USB_ETH_MULTICAST].bytes),
+  OID_COUNTER(OID_GEN_MULTICAST_FRAMES_RCV, usb_eth_stat.rx[USB_ETH_MULTICAST].frames),
+  OID_COUNTER(OID_GEN_BROADCAST_BYTES_RCV,  usb_eth_stat.rx[USB_ETH_BROADCAST].bytes),
+  OID_COUNTER(OID_GEN_BROADCAST_FRAMES_RCV, usb_eth_stat.rx[USB_ETH_BROADCAST].frames),
+  OID_DATA (OID_802_3_PERMANENT_ADDRESS,    permanent_hwaddr, 6, NULL),
+  OID_DATA (OID_802_3_CURRENT_ADDRESS,      station_hwaddr, 6, NULL),
+  OID_QUERY(OID_802_3_MULTICAST_LIST,       rndis_oid_multicast_list, rndis_oid_set_multicast_list),
+  OID_VALUE(OID_802_3_MAXIMUM_LIST_SIZE,    RNDIS_MULTICAST_MAX),
+  OID_VALUE(OID_802_3_MAC_OPTIONS,          0),
+  OID_VALUE(OID_802_3_RCV_ERROR_ALIGNMENT,  0),
+  OID_VALUE(OID_802_3_XMIT_ONE_COLLISION,   0),
+  OID_VALUE(OID_802_3_XMIT_MORE_COLLISIONS, 0),
+  OID_QUERY(OID_TCP_TASK_OFFLOAD,           rndis_oid_task_offload, rndis_oid_set_task_offload),
 };
 
-#define OID_LIST_LENGTH ARRAY_SIZE(OIDSupportedList)
-#define ENC_BUF_SIZE    (OID_LIST_LENGTH * 4 + 32)
+static int rndis_oid_supported_list(void *info)
+{
+  uint32_t *list = info;
+
+  for (unsigned i = 0; i < ARRAY_SIZE(rndis_oids); i++)
+    list[i] = rndis_oids[i].oid;
 
-static uint8_t encapsulated_buffer[ENC_BUF_SIZE];
+  return 4 * ARRAY_SIZE(rndis_oids);
+}
+
+static const rndis_oid_t *rndis_find_oid(rndis_Oid_t oid)
+{
+  int lo = 0, hi = ARRAY_SIZE(rndis_oids) - 1;
+
+  while (lo <= hi)
+  {
+    int mid = (lo + hi) / 2;
+
+    if (rndis_oids[mid].oid == oid)
+      return &rndis_oids[mid];
+    else if (rndis_oids[mid].oid < oid)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+
+  return NULL;
+}
+
+#ifdef DEBUG
+/* a table out of order would make OIDs silently unanswerable */
+static void rndis_check_oids(void)
+{
+  for (unsigned i = 1; i < ARRAY_SIZE(rndis_oids); i++)
+    if (rndis_oids[i - 1].oid >= rndis_oids[i].oid)
+      while (1);
+}
+#endif
+
+_Static_assert(ARRAY_SIZE(rndis_oids) * 4 + 32 <= RNDIS_RESPONSE_SIZE, "RNDIS_RESPONSE_SIZE too small for OID_GEN_SUPPORTED_LIST");
+
+/* requests are parsed where the control endpoint received them; the answer is built in the slot after the newest queued response */
+static alignas(4) uint8_t rndis_responses[RNDIS_RESPONSE_QUEUE_LEN][RNDIS_RESPONSE_SIZE];
+static unsigned response_head, response_tail;
+static bool response_notified; /* a RESPONSE_AVAILABLE is out that the host has not fetched yet */
+#define encapsulated_buffer rndis_responses[response_head & (RNDIS_RESPONSE_QUEUE_LEN - 1)]
 
-/* provide window between usb_rndis.c and rndis.c */
-const uint8_t *const rndis_class_buffer = encapsulated_buffer;
-uint32_t *const rndis_class_msg_size = &((rndis_generic_msg_t *)encapsulated_buffer)->MessageLength;
 extern int usb_rndis_xmit_size;
 
+static void rndis_notify(void)
+{
+  if (!response_notified && (response_head != response_tail))
+  {
+    response_notified = true;
+    usb_rndis_report(ndis_report, sizeof(ndis_report));
+  }
+}
+
+/* queue the response built in encapsulated_buffer; the host hears of it once those ahead are fetched */
 static void rndis_report(void)
 {
-  usb_rndis_report(ndis_report, sizeof(ndis_report));
+  response_head++;
+  rndis_notify();
 }
 
-static void rndis_query_cmplt32(int status, uint32_t data)
+/* discard every unread response, as RESET and INITIALIZE require */
+static void rndis_flush_responses(void)
 {
-  rndis_query_cmplt_t *c;
-  c = (rndis_query_cmplt_t *)encapsulated_buffer;
-  c->MessageType = REMOTE_NDIS_QUERY_CMPLT;
-  c->MessageLength = sizeof(rndis_query_cmplt_t) + 4;
-  c->InformationBufferLength = 4;
-  c->InformationBufferOffset = 16;
-  c->Status = status;
-  memcpy(c + 1, &data, sizeof(data));
-  rndis_report();
+  response_tail = response_head;
+  response_notified = false;
 }
 
-static void rndis_query_cmplt(int status, const void *data, int size)
+/* oldest queued response for GET_ENCAPSULATED_RESPONSE, or NULL when none is waiting */
+const uint8_t *rndis_class_response(uint32_t *size)
 {
-  rndis_query_cmplt_t *c;
-  c = (rndis_query_cmplt_t *)encapsulated_buffer;
+  const uint8_t *r;
+
+  if (response_head == response_tail)
+    return NULL;
+
+  r = rndis_responses[response_tail & (RNDIS_RESPONSE_QUEUE_LEN - 1)];
+  *size = ((const rndis_generic_msg_t *)r)->MessageLength;
+  return r;
+}
+
+/* the host has fetched the oldest response; tell it about the next one, if any */
+void rndis_class_response_done(void)
+{
+  if (response_head != response_tail)
+    response_tail++;
+  response_notified = false;
+  rndis_notify();
+}
+
+static void rndis_query(const rndis_query_msg_t *m)
+{
+  const rndis_oid_t *oid = rndis_find_oid(m->Oid);
+  rndis_query_cmplt_t *c = (rndis_query_cmplt_t *)encapsulated_buffer;
+  uint32_t status = RNDIS_STATUS_SUCCESS;
+  int size = 0;
+
+  if (oid && oid->query)
+    size = oid->query(c + 1);
+  else if (oid && oid->data)
+  {
+    SYS_ARCH_DECL_PROTECT(lev);
+
+    /* like NDIS miniports, answer 64-bit counters with their low half when the host only offers 4 bytes */
+    size = oid->size;
+    if ((8 == size) && (m->InformationBufferLength < 8))
+      size = 4;
+    /* a 64-bit counter is two stores on the M0+: snapshot it whole */
+    SYS_ARCH_PROTECT(lev);
+    memcpy(c + 1, oid->data, size);
+    SYS_ARCH_UNPROTECT(lev);
+  }
+  else
+    status = RNDIS_STATUS_FAILURE;
+
+  c->RequestId = m->RequestId;
   c->MessageType = REMOTE_NDIS_QUERY_CMPLT;
   c->MessageLength = sizeof(rndis_query_cmplt_t) + size;
   c->InformationBufferLength = size;
   c->InformationBufferOffset = 16;
   c->Status = status;
-  memcpy(c + 1, data, size);
   rndis_report();
 }
 
-#define MAC_OPT NDIS_MAC_OPTION_COPY_LOOKAHEAD_DATA | \
-      NDIS_MAC_OPTION_RECEIVE_SERIALIZED  | \
-      NDIS_MAC_OPTION_TRANSFERS_NOT_PEND  | \
-      NDIS_MAC_OPTION_NO_LOOPBACK
+static int rndis_addr_class(const uint8_t *dst)
+{
+  if (!(dst[0] & 1))
+    return USB_ETH_DIRECTED;
 
-static const char *rndis_vendor = RNDIS_VENDOR;
+  return memcmp(dst, broadcast_hwaddr, 6) ? USB_ETH_MULTICAST : USB_ETH_BROADCAST;
+}
 
-static void rndis_query(void)
+static void rndis_count(usb_eth_count_t *count, uint32_t size)
 {
-  switch (((rndis_query_msg_t *)encapsulated_buffer)->Oid)
-  {
-    case OID_GEN_SUPPORTED_LIST:         rndis_query_cmplt(RNDIS_STATUS_SUCCESS, OIDSupportedList, 4 * OID_LIST_LENGTH); return;
-    case OID_GEN_VENDOR_DRIVER_VERSION:  rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, 0x00001000);  return;
-    case OID_802_3_CURRENT_ADDRESS:      rndis_query_cmplt(RNDIS_STATUS_SUCCESS, &station_hwaddr, 6); return;
-    case OID_802_3_PERMANENT_ADDRESS:    rndis_query_cmplt(RNDIS_STATUS_SUCCESS, &permanent_hwaddr, 6); return;
-    case OID_GEN_MEDIA_SUPPORTED:        rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, NDIS_MEDIUM_802_3); return;
-    case OID_GEN_MEDIA_IN_USE:           rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, NDIS_MEDIUM_802_3); return;
-    case OID_GEN_PHYSICAL_MEDIUM:        rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, NDIS_MEDIUM_802_3); return;
-    case OID_GEN_HARDWARE_STATUS:        rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
-    case OID_GEN_LINK_SPEED:             rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, RNDIS_LINK_SPEED / 100); return;
-    case OID_GEN_VENDOR_ID:              rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, 0x00FFFFFF); return;
-    case OID_GEN_VENDOR_DESCRIPTION:     rndis_query_cmplt(RNDIS_STATUS_SUCCESS, rndis_vendor, strlen(rndis_vendor) + 1); return;
-    case OID_GEN_CURRENT_PACKET_FILTER:  rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, oid_packet_filter); return;
-    case OID_GEN_MAXIMUM_FRAME_SIZE:     rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, ETH_MAX_PACKET_SIZE - ETH_HEADER_SIZE); return;
-    case OID_GEN_MAXIMUM_TOTAL_SIZE:     rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, ETH_MAX_PACKET_SIZE); return;
-    case OID_GEN_TRANSMIT_BLOCK_SIZE:    rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, ETH_MAX_PACKET_SIZE); return;
-    case OID_GEN_RECEIVE_BLOCK_SIZE:     rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, ETH_MAX_PACKET_SIZE); return;
-    case OID_GEN_MEDIA_CONNECT_STATUS:   rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, NDIS_MEDIA_STATE_CONNECTED); return;
-    case OID_GEN_RNDIS_CONFIG_PARAMETER: rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
-    case OID_802_3_MAXIMUM_LIST_SIZE:    rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, 1); return;
-    case OID_802_3_MULTICAST_LIST:       rndis_query_cmplt32(RNDIS_STATUS_NOT_SUPPORTED, 0); return;
-    case OID_802_3_MAC_OPTIONS:          rndis_query_cmplt32(RNDIS_STATUS_NOT_SUPPORTED, 0); return;
-    case OID_GEN_MAC_OPTIONS:            rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, /*MAC_OPT*/ 0); return;
-    case OID_802_3_RCV_ERROR_ALIGNMENT:  rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
-    case OID_802_3_XMIT_ONE_COLLISION:   rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
-    case OID_802_3_XMIT_MORE_COLLISIONS: rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
-    case OID_GEN_XMIT_OK:                rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, usb_eth_stat.txok); return;
-    case OID_GEN_RCV_OK:                 rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, usb_eth_stat.rxok); return;
-    case OID_GEN_RCV_ERROR:              rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, usb_eth_stat.rxbad); return;
-    case OID_GEN_XMIT_ERROR:             rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, usb_eth_stat.txbad); return;
-    case OID_GEN_RCV_NO_BUFFER:          rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
-    default:                             rndis_query_cmplt(RNDIS_STATUS_FAILURE, NULL, 0); return;
-  }
+  count->frames++;
+  count->bytes += size;
 }
 
-#define INFBUF ((uint32_t *)((uint8_t *)&(m->RequestId) + m->InformationBufferOffset))
+/* whether the host's packet filter lets a frame from the device through */
+static bool rndis_packetFilter(const uint8_t *dst, int class)
+{
+  if (oid_packet_filter & NDIS_PACKET_TYPE_PROMISCUOUS)
+    return true;
+
+  if (USB_ETH_DIRECTED == class)
+    return (oid_packet_filter & NDIS_PACKET_TYPE_DIRECTED) && !memcmp(dst, station_hwaddr, 6);
+
+  if (USB_ETH_BROADCAST == class)
+    return oid_packet_filter & NDIS_PACKET_TYPE_BROADCAST;
 
-static void rndis_handle_config_parm(const char *data, int keyoffset, int valoffset, int keylen, int vallen)
+  if (oid_packet_filter & NDIS_PACKET_TYPE_ALL_MULTICAST)
+    return true;
+
+  return (oid_packet_filter & NDIS_PACKET_TYPE_MULTICAST) && rndis_multicast_match(&host_multicast, dst);
+}
+
+/* whether a frame from the host is addressed to the device; checked before any pbuf is allocated */
+static bool rndis_rx_filter(const uint8_t *dst, int class)
 {
-    (void)data;
-    (void)keyoffset;
-    (void)valoffset;
-    (void)keylen;
-    (void)vallen;
+  if (USB_ETH_DIRECTED == class)
+  {
+    if (!memcmp(dst, device_hwaddr, 6))
+      return true;
+
+    usb_eth_stat.rxdrop_unicast++;
+    return false;
+  }
+
+  if (USB_ETH_BROADCAST == class)
+    return true;
+
+  if (rndis_multicast_match(&rx_multicast, dst))
+    return true;
+
+  usb_eth_stat.rxdrop_multicast++;
+  return false;
 }
 
-static void rndis_packetFilter(uint32_t newfilter)
+static void rndis_handle_set_msg(const rndis_set_msg_t *m)
 {
-    (void)newfilter;
+  rndis_set_cmplt_t *c = (rndis_set_cmplt_t *)encapsulated_buffer;
+  const rndis_oid_t *oid = rndis_find_oid(m->Oid);
+  /* InformationBufferOffset counts from RequestId; rndis_class_set_handler() checked MessageLength covers it */
+  uint32_t info_room = m->MessageLength - offsetof(rndis_set_msg_t, RequestId);
+
+  /* each bound on its own, as offset + length could wrap; Power Managment and anything else not in the table fails */
+  if ((m->InformationBufferOffset > info_room) || (m->InformationBufferLength > info_room - m->InformationBufferOffset))
+    c->Status = RNDIS_STATUS_INVALID_DATA;
+  else if (oid && oid->set)
+    c->Status = oid->set((const uint8_t *)&m->RequestId + m->InformationBufferOffset, m->InformationBufferLength);
+  else
+    c->Status = RNDIS_STATUS_FAILURE;
+
+  c->RequestId = m->RequestId;
+  c->MessageType = REMOTE_NDIS_SET_CMPLT;
+  c->MessageLength = sizeof(rndis_set_cmplt_t);
+  rndis_report();
 }
 
-void rndis_handle_set_msg(void)
+/* received transfers whose messages have not all reached the application yet, oldest first (see usb_rndis_recv_renew()) */
+typedef struct
 {
-  rndis_set_cmplt_t *c;
-  rndis_set_msg_t *m;
-  rndis_Oid_t oid;
+  struct pbuf *transfer;
+  int pos;  /* of the next message */
+  int size; /* from there to the end */
+} rndis_recv_t;
 
-  c = (rndis_set_cmplt_t *)encapsulated_buffer;
-  m = (rndis_set_msg_t *)encapsulated_buffer;
+static rndis_recv_t recv_parked[USB_RNDIS_RX_BANKS];
+static unsigned recv_parked_head, recv_parked_tail;
 
-  oid = m->Oid;
-  c->MessageType = REMOTE_NDIS_SET_CMPLT;
-  c->MessageLength = sizeof(rndis_set_cmplt_t);
-  c->Status = RNDIS_STATUS_SUCCESS;
+/* hand a transfer's frames on while the receive queue and the pbuf pool have room; true once all are */
+static bool rndis_recv_walk(rndis_recv_t *r)
+{
+  uint8_t *data = (uint8_t *)r->transfer->payload;
+  rndis_data_packet_t *p;
+  struct pbuf *frame;
+  uint32_t offset;
+  int class;
 
-  switch (oid)
+  /* anything shorter than a header is the one-byte padding hosts use in place of a ZLP */
+  while (r->size >= (int)sizeof(rndis_data_packet_t))
   {
-    /* Parameters set up in 'Advanced' tab */
-    case OID_GEN_RNDIS_CONFIG_PARAMETER:
-      {
-        rndis_config_parameter_t *p;
-        char *ptr = (char *)m;
-        ptr += sizeof(rndis_generic_msg_t);
-        ptr += m->InformationBufferOffset;
-        p = (rndis_config_parameter_t *)ptr;
-        rndis_handle_config_parm(ptr, p->ParameterNameOffset, p->ParameterValueOffset, p->ParameterNameLength, p->ParameterValueLength);
-      }
+    p = (rndis_data_packet_t *)(data + r->pos);
+
+    if (r->pos & 3)
       break;
+    if ( (p->MessageType != REMOTE_NDIS_PACKET_MSG) || (p->MessageLength < sizeof(rndis_data_packet_t)) || (p->MessageLength > r->size) )
+      break;
+
+    offset = p->DataOffset + offsetof(rndis_data_packet_t, DataOffset);
+    if ( (offset > p->MessageLength) || (p->DataLength > p->MessageLength - offset) )
+      break;
+
+    offset += r->pos;
+
+    class = (p->DataLength < ETH_HEADER_SIZE) ? -1 : rndis_addr_class(data + offset);
+
+    if (class < 0)
+    {
+      usb_eth_stat.rxbad++;
+    }
+    else if (rndis_rx_filter(data + offset, class))
+    {
+      /* stop at the frame there is no room for, and go on from it when there is */
+      if (usb_eth_recv_full())
+        return false;
 
-    /* Mandatory general OIDs */
-    case OID_GEN_CURRENT_PACKET_FILTER:
-      oid_packet_filter = *INFBUF;
-      if (oid_packet_filter)
+      if (r->size - p->MessageLength < (int)sizeof(rndis_data_packet_t))
       {
-        rndis_packetFilter(oid_packet_filter);
-        rndis_state = rndis_data_initialized;
-      } 
-      else 
+        /* the last (usually only) message keeps the pool buffer it was received into */
+        frame = r->transfer;
+        r->transfer = NULL;
+        pbuf_remove_header(frame, offset);
+        pbuf_realloc(frame, p->DataLength);
+      }
+      else
       {
-        rndis_state = rndis_initialized;
+        frame = pbuf_alloc(PBUF_RAW, p->DataLength, PBUF_POOL);
+        if (!frame)
+          return false;
+        pbuf_take(frame, data + offset, p->DataLength);
       }
-      break;
 
-    case OID_GEN_CURRENT_LOOKAHEAD:
-      break;
+      usb_eth_stat.rxok++;
+      rndis_count(&usb_eth_stat.rx[class], p->DataLength);
+      usb_eth_recv_callback(frame);
+    }
 
-    case OID_GEN_PROTOCOL_OPTIONS:
-      break;
+    r->pos += p->MessageLength;
+    r->size -= p->MessageLength;
+  }
 
-    /* Mandatory 802_3 OIDs */
-    case OID_802_3_MULTICAST_LIST:
-      break;
+  if (r->size >= (int)sizeof(rndis_data_packet_t))
+    usb_eth_stat.rxbad++;
 
-    /* Power Managment: fails for now */
-    case OID_PNP_ADD_WAKE_UP_PATTERN:
-    case OID_PNP_REMOVE_WAKE_UP_PATTERN:
-    case OID_PNP_ENABLE_WAKE_UP:
-    default:
-      c->Status = RNDIS_STATUS_FAILURE;
-      break;
+  if (r->transfer)
+    pbuf_free(r->transfer);
+
+  return true;
+}
+
+void rndis_recv_resume(void)
+{
+  uint64_t rxok = usb_eth_stat.rxok;
+  PERF_START;
+
+  while ((recv_parked_tail != recv_parked_head) && rndis_recv_walk(&recv_parked[recv_parked_tail % USB_RNDIS_RX_BANKS]))
+    recv_parked_tail++;
+
+  /* polled from the main loop: only the calls that pass lwIP frames are timed, not those finding nothing parked or no pbuf free */
+  if (usb_eth_stat.rxok != rxok)
+    PERF_STOP("rndis_recv_resume");
+}
+
+int rndis_recv_parked(void)
+{
+  return recv_parked_head - recv_parked_tail;
+}
+
+/* the bulk endpoints restarted: what was received before is dropped with the rest */
+void rndis_recv_flush(void)
+{
+  for (; recv_parked_tail != recv_parked_head; recv_parked_tail++)
+  {
+    rndis_recv_t *r = &recv_parked[recv_parked_tail % USB_RNDIS_RX_BANKS];
+
+    if (r->transfer)
+      pbuf_free(r->transfer);
   }
+}
 
-  /* c->MessageID is same as before */
-  rndis_report();
-  return;
+void rndis_recv_callback(struct pbuf *transfer, int size)
+{
+  rndis_recv_t *r = &recv_parked[recv_parked_head++ % USB_RNDIS_RX_BANKS];
+
+  r->transfer = transfer;
+  r->pos = 0;
+  r->size = size;
+
+  /* walks it, as far as there is room, and re-arms the banks not held */
+  usb_rndis_recv_renew();
 }
 
-void rndis_recv_callback(uint8_t *data, int size)
+/* CDC-ECM framing: the transfer is one bare Ethernet frame, passed on in the buffer it arrived in */
+void rndis_ecm_recv_callback(struct pbuf *frame, int size)
 {
-  rndis_data_packet_t *p;
-  p = (rndis_data_packet_t *)data;
+  const uint8_t *dst = (const uint8_t *)frame->payload;
+  int class = rndis_addr_class(dst);
 
-  if (size >= sizeof(rndis_data_packet_t))
-    if ( (p->MessageType == REMOTE_NDIS_PACKET_MSG) && (p->MessageLength <= size))
-      if ( (p->DataOffset + offsetof(rndis_data_packet_t, DataOffset) + p->DataLength) <= size)
-      {
-        usb_eth_stat.rxok++;
-        usb_rndis_recv_callback(&data[p->DataOffset + offsetof(rndis_data_packet_t, DataOffset)], p->DataLength);
-        return;
+  if (size < ETH_HEADER_SIZE)
+  {
+    usb_eth_stat.rxbad++;
+    pbuf_free(frame);
+  }
+  else if (!rndis_rx_filter(dst, class))
+  {
+    pbuf_free(frame);
+  }
+  else
+  {
+    usb_eth_stat.rxok++;
+    rndis_count(&usb_eth_stat.rx[class], size);
+    pbuf_realloc(frame, size);
+
+    if (!usb_eth_recv_callback(frame))
+    {
+      usb_eth_stat.rxnobuf++;
+      pbuf_free(frame);
     }
+  }
 
-  usb_eth_stat.rxbad++;
   usb_rndis_recv_renew();
 }
 
 void rndis_class_set_handler(uint8_t *data, int size)
 {
-  memcpy(encapsulated_buffer, data, size);
-  switch (((rndis_generic_msg_t *)data)->MessageType)
+  const rndis_generic_msg_t *msg = (const rndis_generic_msg_t *)data;
+  uint32_t type = msg->MessageType;
+
+  /* the data stage must hold the whole message, and every message we answer carries a RequestId */
+  if ((size < (int)(sizeof(rndis_generic_msg_t) + sizeof(rndis_RequestId_t))) ||
+      (msg->MessageLength > (uint32_t)size) || (msg->MessageLength < sizeof(rndis_generic_msg_t) + sizeof(rndis_RequestId_t)))
+  {
+    usb_eth_stat.ctrldrop++;
+    return;
+  }
+
+  /* a new session or a reset makes any unread responses stale, and the host checksums everything again */
+  if ((REMOTE_NDIS_INITIALIZE_MSG == type) || (REMOTE_NDIS_RESET_MSG == type))
+  {
+    rndis_flush_responses();
+    rndis_checksum_offload(0);
+  }
+
+  /* no slot left to answer in: drop the request and let the host time it out */
+  if (response_head - response_tail >= RNDIS_RESPONSE_QUEUE_LEN)
+  {
+    usb_eth_stat.ctrldrop++;
+    return;
+  }
+
+  switch (type)
   {
     case REMOTE_NDIS_INITIALIZE_MSG:
       {
         rndis_initialize_cmplt_t *m;
+        uint32_t host_max = ((const rndis_initialize_msg_t *)data)->MaxTransferSize;
+#ifdef DEBUG
+        rndis_check_oids();
+#endif
+        /* never pack more into an IN transfer than the host said it can take */
+        usb_rndis_xmit_size = (host_max && (host_max < RNDIS_BUFFER_SIZE)) ? host_max : RNDIS_BUFFER_SIZE;
         m = ((rndis_initialize_cmplt_t *)encapsulated_buffer);
-        /* m->MessageID is same as before */
+        m->RequestId = ((const rndis_initialize_msg_t *)data)->RequestId;
         m->MessageType = REMOTE_NDIS_INITIALIZE_CMPLT;
         m->MessageLength = sizeof(rndis_initialize_cmplt_t);
         m->MajorVersion = RNDIS_MAJOR_VERSION;
@@ -272,22 +810,23 @@ void rndis_class_set_handler(uint8_t *data, int size)
         m->Status = RNDIS_STATUS_SUCCESS;
         m->DeviceFlags = RNDIS_DF_CONNECTIONLESS;
         m->Medium = RNDIS_MEDIUM_802_3;
-        m->MaxPacketsPerTransfer = 1;
+        m->MaxPacketsPerTransfer = RNDIS_MAX_PACKETS_PER_TRANSFER;
         m->MaxTransferSize = RNDIS_BUFFER_SIZE;
-        m->PacketAlignmentFactor = 0;
+        m->PacketAlignmentFactor = (RNDIS_MAX_PACKETS_PER_TRANSFER > 1) ? 2 : 0; /* batched messages start on 32-bit boundaries */
         m->AfListOffset = 0;
         m->AfListSize = 0;
         rndis_state = rndis_initialized;
+        time_link_mark(TIME_LINK_RNDIS_INITIALIZE);
         rndis_report();
       }
       break;
 
     case REMOTE_NDIS_QUERY_MSG:
-      rndis_query();
+      rndis_query((const rndis_query_msg_t *)data);
       break;
       
     case REMOTE_NDIS_SET_MSG:
-      rndis_handle_set_msg();
+      rndis_handle_set_msg((const rndis_set_msg_t *)data);
       break;
 
     case REMOTE_NDIS_RESET_MSG:
@@ -308,6 +847,7 @@ void rndis_class_set_handler(uint8_t *data, int size)
       {
         rndis_keepalive_cmplt_t * m;
         m = (rndis_keepalive_cmplt_t *)encapsulated_buffer;
+        m->RequestId = ((const rndis_keepalive_msg_t *)data)->RequestId;
         m->MessageType = REMOTE_NDIS_KEEPALIVE_CMPLT;
         m->MessageLength = sizeof(rndis_keepalive_cmplt_t);
         m->Status = RNDIS_STATUS_SUCCESS;
@@ -321,27 +861,47 @@ void rndis_class_set_handler(uint8_t *data, int size)
   }
 }
 
-void rndis_send(struct pbuf *p)
+/* fill in the REMOTE_NDIS_PACKET_MSG header for a frame, returning the (possibly truncated) frame size */
+int rndis_packet_header(rndis_data_packet_t *hdr, int size)
 {
-  rndis_data_packet_t hdr;
-  int max_size;
-  struct pbuf *q;
-  int size;
-
-  for(q = p, size = 0; q != NULL; q = q->next)
-    size += q->len;
+  int max_size = usb_rndis_xmit_size - sizeof(rndis_data_packet_t);
 
-  memset(&hdr, 0, sizeof(hdr));
-  hdr.MessageType = REMOTE_NDIS_PACKET_MSG;
-  hdr.MessageLength = sizeof(rndis_data_packet_t) + size;
-  hdr.DataOffset = sizeof(rndis_data_packet_t) - offsetof(rndis_data_packet_t, DataOffset);
-
-  max_size = usb_rndis_xmit_size - sizeof(rndis_data_packet_t);
   if (size > max_size)
     size = max_size;
 
-  hdr.DataLength = size;
+  memset(hdr, 0, sizeof(rndis_data_packet_t));
+  hdr->MessageType = REMOTE_NDIS_PACKET_MSG;
+  hdr->MessageLength = sizeof(rndis_data_packet_t) + size;
+  hdr->DataOffset = sizeof(rndis_data_packet_t) - offsetof(rndis_data_packet_t, DataOffset);
+  hdr->DataLength = size;
+
+  return size;
+}
+
+err_t rndis_send(struct pbuf *p)
+{
+  /* lwIP keeps the Ethernet header in the first pbuf */
+  int class = rndis_addr_class((uint8_t *)p->payload);
+  err_t err;
+
+  if (!rndis_packetFilter((uint8_t *)p->payload, class))
+  {
+    usb_eth_stat.txdrop_filter++;
+    return ERR_OK;
+  }
+
+  err = usb_rndis_xmit_packet(p);
+  if (ERR_OK == err)
+  {
+    usb_eth_stat.txok++;
+    rndis_count(&usb_eth_stat.tx[class], p->tot_len);
+  }
+  else
+  {
+    usb_eth_stat.txbad++;
+  }
 
-  usb_rndis_xmit_packet((uint8_t *)&hdr, sizeof(hdr), p, size);
+  return err;
 }
 
+#endif /* !USB_NCM */
@@ -33,18 +33,56 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "rndis_protocol.h"
+#include "lwip/err.h"
 
 #define RNDIS_MTU        1500                           /* MTU value */
 #define RNDIS_LINK_SPEED 12000000                       /* Link baudrate (12Mbit/s for USB-FS) */
 #define RNDIS_VENDOR     "acme"                         /* NIC vendor name */
 #define RNDIS_HWADDR     0x20,0x89,0x84,0x6A,0x96,0xAB  /* MAC-address to set to host interface */
+#define RNDIS_HWADDR_STRING "2089846A96AB"              /* the same, as the CDC iMACAddress string (ECM, NCM) */
+#define RNDIS_DEVICE_HWADDR 0x20,0x89,0x84,0x6A,0x96,0x00 /* MAC-address of the device's own (lwIP) interface */
+#define RNDIS_MULTICAST_MAX 8                           /* entries in each multicast list (device's own groups, host's list) */
+#ifndef RNDIS_MAX_PACKETS_PER_TRANSFER
+#define RNDIS_MAX_PACKETS_PER_TRANSFER 8                /* REMOTE_NDIS_PACKET_MSGs batched into one bulk transfer (1 disables batching) */
+#endif
+#define RNDIS_RESPONSE_QUEUE_LEN 4                      /* control responses awaiting GET_ENCAPSULATED_RESPONSE (power of two) */
+#define RNDIS_RESPONSE_SIZE      256                    /* bytes in each; OID_GEN_SUPPORTED_LIST's answer is the longest */
 
 #define ETH_HEADER_SIZE             14
 #define ETH_MAX_PACKET_SIZE         ETH_HEADER_SIZE + RNDIS_MTU
 #define RNDIS_BUFFER_SIZE           (ETH_MAX_PACKET_SIZE + sizeof(rndis_data_packet_t))
 
-void rndis_recv_callback(uint8_t *data, int size);
+/* the lwIP glue's receive queue; false when it is full */
+bool usb_eth_recv_callback(struct pbuf *p);
+bool usb_eth_recv_full(void);
+/* the host stopped (or resumed) computing the NDIS_TASK_CHECKSUM_* checksums of IPv4 frames it sends */
+void usb_eth_checksum_callback(uint32_t offloaded);
+/* pbuf_copy_partial() for the IN endpoint's buffers, counting the bytes in usb_eth_stat */
+int usb_eth_xmit_copy(struct pbuf *p, void *buffer, int size);
+
+/* app.c's httpd file hooks */
+typedef struct {
+  uint32_t requests;   /* files httpd opened */
+  uint64_t file_bytes; /* their size */
+  uint32_t ram_last;   /* lwIP RAM the latest request added at its peak: heap, TCP segments and PBUF_ROM references */
+  uint32_t ram_max;    /* the most any request added */
+} http_stat_t;
+
+extern http_stat_t http_stat;
+
+void rndis_recv_callback(struct pbuf *transfer, int size);
+void rndis_recv_resume(void);
+int rndis_recv_parked(void);
+void rndis_recv_flush(void);
+void rndis_ecm_recv_callback(struct pbuf *frame, int size);
+void rndis_set_packet_filter(uint32_t filter);
 void rndis_class_set_handler(uint8_t *data, int size);
-void rndis_send(struct pbuf *p);
+const uint8_t *rndis_class_response(uint32_t *size);
+void rndis_class_response_done(void);
+err_t rndis_send(struct pbuf *p);
+int rndis_packet_header(rndis_data_packet_t *hdr, int size);
+bool rndis_multicast_filter(const uint8_t *addr, bool add);
+
+extern usb_eth_stat_t usb_eth_stat;
 
 #endif
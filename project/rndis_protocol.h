@@ -51,6 +51,7 @@
 
 #define RNDIS_STATUS_SUCCESS            0X00000000
 #define RNDIS_STATUS_FAILURE            0XC0000001
+#define RNDIS_STATUS_INVALID_LENGTH     0XC0010014
 #define RNDIS_STATUS_INVALID_DATA       0XC0010015
 #define RNDIS_STATUS_NOT_SUPPORTED      0XC00000BB
 #define RNDIS_STATUS_MEDIA_CONNECT      0X4001000B
@@ -287,6 +288,33 @@ typedef struct{
 	rndis_ClassInformationOffset_t	ClassInformationType;
 	}rndis_OOB_packet_t;
 
+/*** NDIS 5 task offload (OID_TCP_TASK_OFFLOAD) ***/
+
+typedef struct{
+	uint32_t		Version;
+	uint32_t		Size;
+	uint32_t		Reserved;
+	uint32_t		OffsetFirstTask;	/* from the start of this header, 0 for none */
+	uint32_t		Encapsulation;
+	uint32_t		EncapsulationFlags;
+	uint32_t		EncapsulationHeaderSize;
+	}ndis_task_offload_header_t;
+
+typedef struct{
+	uint32_t		Version;
+	uint32_t		Size;
+	uint32_t		Task;
+	uint32_t		OffsetNextTask;	/* from the start of this task, 0 for the last */
+	uint32_t		TaskBufferLength;
+	}ndis_task_offload_t;
+
+typedef struct{
+	uint32_t		V4Transmit;
+	uint32_t		V4Receive;
+	uint32_t		V6Transmit;
+	uint32_t		V6Receive;
+	}ndis_task_tcp_ip_checksum_t;
+
 #include "ndis.h"
 
 typedef enum rnids_state_e {
@@ -295,11 +323,36 @@ typedef enum rnids_state_e {
 	rndis_data_initialized
 	} rndis_state_t;
 
+/* destination classes, indexing usb_eth_stat_t.rx[] and tx[] */
+enum {
+	USB_ETH_DIRECTED,
+	USB_ETH_MULTICAST,
+	USB_ETH_BROADCAST,
+	USB_ETH_CLASSES
+	};
+
+typedef struct {
+	uint64_t		frames;
+	uint64_t		bytes;
+} usb_eth_count_t;
+
+/* 64-bit so they do not wrap in the field; a counter takes two stores on the M0+, so queries copy them with interrupts masked */
 typedef struct {
-	uint32_t		txok;
-	uint32_t		rxok;
-	uint32_t		txbad;
-	uint32_t		rxbad;
+	uint64_t		txok;
+	uint64_t		rxok;
+	uint64_t		txbad;	/* frames refused because the transmit queue was full */
+	uint64_t		rxbad;
+	uint64_t		rxnobuf;	/* frames dropped for want of a pbuf or receive queue slot */
+	uint32_t		rxqueuemax;	/* receive queue high-water mark */
+	uint32_t		rxdrop_unicast;	/* frames for another station, dropped before any pbuf was allocated */
+	uint32_t		rxdrop_multicast;	/* frames for a multicast group the device is not in, likewise */
+	uint32_t		txdrop_filter;	/* frames the host's OID_GEN_CURRENT_PACKET_FILTER does not accept */
+	uint32_t		ctrldrop;	/* control messages dropped because RNDIS_RESPONSE_QUEUE_LEN responses were unread */
+	uint64_t		txinplace;	/* bytes the IN endpoint read straight out of their pbuf */
+	uint64_t		txcopied;	/* bytes copied into a staging buffer or NTB for the IN endpoint */
+	uint64_t		txcopied_rom;	/* those of them read out of flash (PBUF_ROM, e.g. httpd files): their one and only copy */
+	usb_eth_count_t	rx[USB_ETH_CLASSES];	/* frames passed on to lwIP */
+	usb_eth_count_t	tx[USB_ETH_CLASSES];	/* frames queued for the host */
 } usb_eth_stat_t;
 
 #endif /* _RNDIS_H */
@@ -72,4 +72,13 @@ typedef int sys_prot_t;
 
 #define LWIP_PLATFORM_ASSERT(x) do { if(!(x)) while(1); } while(0)
 
+/* word-at-a-time Internet checksum tuned for the Cortex-M0+ (chksum.c) */
+#include <stdint.h>
+
+uint16_t arch_chksum(const void *dataptr, int len);
+uint16_t arch_chksum_copy(void *dst, const void *src, uint16_t len);
+
+#define LWIP_CHKSUM                     arch_chksum
+#define LWIP_CHKSUM_COPY(dst, src, len) arch_chksum_copy(dst, src, len)
+
 #endif /* __CC_H__ */
@@ -0,0 +1,124 @@
+#include <stdbool.h>
+#include <string.h>
+#include "lwip/opt.h"
+#include "lwip/inet_chksum.h"
+
+/*
+  Internet checksum for the Cortex-M0+ (LWIP_CHKSUM and LWIP_CHKSUM_COPY in cc.h).
+  Words are summed into a 64-bit accumulator, which the compiler keeps as an
+  ADDS/ADCS pair, so carries are folded once at the end instead of per add.
+  The result matches lwip_standard_chksum(): the non-inverted sum, with bytes
+  swapped when the data starts at an odd address.
+*/
+
+#define CHKSUM_WORD(i) \
+  do { \
+    uint32_t w = ((const uint32_t *)src)[i]; \
+    if (copy) \
+      ((uint32_t *)dst)[i] = w; \
+    acc += w; \
+  } while (0)
+
+/* copy is a constant at each call, so the copying and the summing-only versions are compiled separately */
+static inline __attribute__((always_inline)) uint16_t chksum(uint8_t *dst, const uint8_t *src, int len, bool copy)
+{
+  uint64_t acc = 0;
+  uint32_t sum;
+  int odd = (mem_ptr_t)src & 1;
+
+  /* reach a word boundary: a leading odd byte is the high half of its pair */
+  if (odd && len > 0)
+  {
+    if (copy)
+      *dst++ = *src;
+    acc = (uint32_t)*src++ << 8;
+    len--;
+  }
+
+  if (((mem_ptr_t)src & 2) && len >= 2)
+  {
+    uint16_t h = *(const uint16_t *)src;
+    if (copy)
+    {
+      *(uint16_t *)dst = h;
+      dst += 2;
+    }
+    acc += h;
+    src += 2;
+    len -= 2;
+  }
+
+  while (len >= 32)
+  {
+    CHKSUM_WORD(0);
+    CHKSUM_WORD(1);
+    CHKSUM_WORD(2);
+    CHKSUM_WORD(3);
+    CHKSUM_WORD(4);
+    CHKSUM_WORD(5);
+    CHKSUM_WORD(6);
+    CHKSUM_WORD(7);
+    src += 32;
+    if (copy)
+      dst += 32;
+    len -= 32;
+  }
+
+  while (len >= 4)
+  {
+    CHKSUM_WORD(0);
+    src += 4;
+    if (copy)
+      dst += 4;
+    len -= 4;
+  }
+
+  if (len >= 2)
+  {
+    uint16_t h = *(const uint16_t *)src;
+    if (copy)
+    {
+      *(uint16_t *)dst = h;
+      dst += 2;
+    }
+    acc += h;
+    src += 2;
+    len -= 2;
+  }
+
+  /* a trailing byte is the low half of its pair */
+  if (len > 0)
+  {
+    if (copy)
+      *dst = *src;
+    acc += *src;
+  }
+
+  /* 2^32 and 2^16 are both 1 modulo 0xffff, so folding halves keeps the sum */
+  acc = (acc & 0xffffffffu) + (acc >> 32);
+  sum = (uint32_t)acc + (uint32_t)(acc >> 32);
+  sum = FOLD_U32T(sum);
+  sum = FOLD_U32T(sum);
+
+  if (odd)
+    sum = SWAP_BYTES_IN_WORD(sum);
+
+  return (uint16_t)sum;
+}
+
+uint16_t arch_chksum(const void *dataptr, int len)
+{
+  return chksum(NULL, (const uint8_t *)dataptr, len, false);
+}
+
+/* checksum while copying (TCP_WRITE_FLAG_COPY with LWIP_CHECKSUM_ON_COPY); word stores need src and dst equally aligned */
+uint16_t arch_chksum_copy(void *dst, const void *src, uint16_t len)
+{
+  if (((mem_ptr_t)dst ^ (mem_ptr_t)src) & 3)
+  {
+    MEMCPY(dst, src, len);
+    return chksum(NULL, (const uint8_t *)src, len, false);
+  }
+
+  return chksum((uint8_t *)dst, (const uint8_t *)src, len, true);
+}
@@ -0,0 +1,29 @@
+#include <string.h>
+#include "lwip/opt.h"
+
+#if LWIP_PERF
+#include "arch/perf.h"
+
+perf_stat_t perf_stats[PERF_SLOTS];
+
+/* names are few and fixed, so a linear search of the slots is good enough */
+void perf_record(const char *name, uint32_t start)
+{
+  uint32_t elapsed = time_cycles() - start;
+  perf_stat_t *stat;
+
+  for (stat = perf_stats; stat < &perf_stats[PERF_SLOTS]; stat++)
+  {
+    if (!stat->name)
+      stat->name = name;
+    else if (strcmp(stat->name, name))
+      continue;
+
+    stat->count++;
+    stat->total += elapsed;
+    if (elapsed > stat->max)
+      stat->max = elapsed;
+    return;
+  }
+}
+#endif /* LWIP_PERF */
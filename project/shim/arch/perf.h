@@ -32,7 +32,31 @@
 #ifndef __PERF_H__
 #define __PERF_H__
 
-#define PERF_START    /* null definition */
-#define PERF_STOP(x)  /* null definition */
+/*
+  With LWIP_PERF, lwIP's hot paths (tcp_input, udp_input, pbuf_free, ...) and
+  the RNDIS receive/transmit paths are timed in CPU cycles. The totals collect
+  in perf_stats[], one slot per PERF_STOP() name, and can be read with a debugger.
+  A span includes any interrupt taken during it (the USB handler with
+  USB_IRQ_MODE), so max is an upper bound on the path's own cost.
+*/
+#include <stdint.h>
+#include "time.h"
+
+#define PERF_SLOTS    12
+
+typedef struct
+{
+  const char *name;
+  uint32_t count;
+  uint32_t total; /* cycles */
+  uint32_t max;   /* cycles */
+} perf_stat_t;
+
+extern perf_stat_t perf_stats[PERF_SLOTS];
+
+void perf_record(const char *name, uint32_t start);
+
+#define PERF_START    uint32_t perf_start = time_cycles()
+#define PERF_STOP(x)  perf_record(x, perf_start)
 
 #endif /* __PERF_H__ */
@@ -42,18 +42,71 @@
 #define LWIP_ICMP                       1
 #define LWIP_UDP                        1
 #define LWIP_TCP                        1
+#define LWIP_IGMP                       1 /* joined groups feed rndis.c's RX multicast filter */
 #define ETH_PAD_SIZE                    0
+#if USB_NCM
+#define PBUF_LINK_ENCAPSULATION_HLEN    0  /* usb_ncm.c copies every frame into an NTB, and its PBUF_RAW frames must pass icmp_input() in place */
+#else
+#define PBUF_LINK_ENCAPSULATION_HLEN    44 /* sizeof(rndis_data_packet_t): lets usb_rndis.c send frames in place */
+#endif
 #define LWIP_IP_ACCEPT_UDP_PORT(p)      ((p) == PP_NTOHS(67))
 
 #define TCP_MSS                         (1500 /*mtu*/ - 20 /*iphdr*/ - 20 /*tcphhr*/)
-#define TCP_SND_BUF                     (2 * TCP_MSS)
+/*
+  The send buffer is counted in segments: httpd enqueues file data by
+  reference to flash (PBUF_ROM), so a segment in flight costs a PBUF_REF/ROM,
+  a tcp_seg and a header pbuf from the heap rather than TCP_MSS of RAM.
+*/
+#define TCP_SND_BUF                     (TCP_SND_SEGS * TCP_MSS)
+#define TCP_SND_QUEUELEN                (2 * TCP_SND_SEGS + 4) /* header and ROM pbuf per segment, plus the HTTP headers */
+
+/* RAM profiles for the 32 KB part; project/membudget.c checks at build time that the chosen one fits */
+#define LWIP_PROFILE_LOW_LATENCY        1 /* shallow pool and window: a frame never queues behind much data */
+#define LWIP_PROFILE_MAX_THROUGHPUT     2 /* deep pool, window and heap for one fast bulk transfer */
+#define LWIP_PROFILE_MAX_CONNECTIONS    3 /* more PCBs and segments, each connection kept to a small window */
+
+#ifndef LWIP_PROFILE
+#define LWIP_PROFILE                    LWIP_PROFILE_LOW_LATENCY
+#endif
+
+#if LWIP_PROFILE == LWIP_PROFILE_LOW_LATENCY
+#define PBUF_POOL_SIZE                  3
+#define TCP_WND                         (2 * TCP_MSS)
+#define TCP_SND_SEGS                    4
+#define MEM_SIZE                        1600
+#elif LWIP_PROFILE == LWIP_PROFILE_MAX_THROUGHPUT
+#define PBUF_POOL_SIZE                  6
+#define TCP_WND                         (4 * TCP_MSS)
+#define TCP_SND_SEGS                    8
+#define MEM_SIZE                        (4 * 1024)
+#define MEMP_NUM_TCP_SEG                24
+#elif LWIP_PROFILE == LWIP_PROFILE_MAX_CONNECTIONS
+#define PBUF_POOL_SIZE                  4
+#define TCP_WND                         (2 * TCP_MSS)
+#define TCP_SND_SEGS                    4
+#define MEM_SIZE                        (4 * 1024)
+#define MEMP_NUM_TCP_PCB                12
+#define MEMP_NUM_TCP_SEG                32
+#define MEMP_NUM_PBUF                   24
+#else
+#error "unknown LWIP_PROFILE"
+#endif
+
+#define LWIP_CHECKSUM_ON_COPY           1 /* TCP sums data while copying it in (arch_chksum_copy) */
+#define LWIP_CHECKSUM_CTRL_PER_NETIF    1 /* checks the host offloads with OID_TCP_TASK_OFFLOAD are skipped (usb_eth_checksum_callback) */
 
 #define ETHARP_SUPPORT_STATIC_ENTRIES   1
 
 #define LWIP_HTTPD_CGI                  1
 #define LWIP_HTTPD_SSI                  1
 #define LWIP_HTTPD_SSI_INCLUDE_TAG      0
+#define LWIP_HTTPD_FILE_STATE           1 /* fs_state_init()/fs_state_free() in app.c measure each request */
 
 #define LWIP_SINGLE_NETIF               1
 
+/* cycle counts of the hot paths, see arch/perf.h */
+#ifndef LWIP_PERF
+#define LWIP_PERF                       0
+#endif
+
 #endif /* __LWIPOPTS_H__ */
@@ -2,19 +2,141 @@
 #include <sam.h>
 #include "time.h"
 
-static volatile uint32_t ticks;
+/*
+  SysTick runs freely and interrupts only when its period (1 ms unless
+  time_sleep() stretched it) expires; sys_now() adds the elapsed part of the
+  running period, so the period can change without the clock losing time
+*/
+static uint32_t cycles_per_ms;
+static volatile uint32_t ticks;  /* whole ms in the completed periods */
+static volatile uint32_t frac;   /* cycles of the completed periods short of a whole ms */
+static volatile uint32_t period; /* cycles in the running period */
+static uint32_t sleep_frac;
+static volatile uint32_t cycles; /* CPU cycles in the completed periods, modulo 2^32 */
+
+time_duty_t time_duty;
+uint32_t time_link[TIME_LINK_PHASES];
+
+static void time_account(uint32_t elapsed)
+{
+  cycles += elapsed;
+  elapsed += frac;
+  ticks += elapsed / cycles_per_ms;
+  frac = elapsed % cycles_per_ms;
+}
 
 void time_init(void)
 {
-  SysTick_Config(SystemCoreClock / 1000);
+  cycles_per_ms = SystemCoreClock / 1000;
+  period = cycles_per_ms;
+  SysTick_Config(cycles_per_ms);
 }
 
 void SysTick_Handler(void)
 {
-  ticks++;
+  time_account(period);
+  period = SysTick->LOAD + 1;
+}
+
+/* with interrupts masked: account a period that expired while the handler could not run */
+static void time_catch_up(void)
+{
+  if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk)
+  {
+    SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+    SysTick_Handler();
+  }
+}
+
+/*
+  with interrupts masked: cycles elapsed in the running period; a wrap after
+  the first check would pair the old period's totals with the new period's VAL,
+  stepping time back by nearly a period, so the flag is checked again after the read
+*/
+static uint32_t time_elapsed(void)
+{
+  uint32_t val;
+
+  time_catch_up();
+  val = SysTick->VAL;
+  if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk)
+  {
+    time_catch_up();
+    val = SysTick->VAL;
+  }
+
+  return period - 1 - val;
 }
 
 uint32_t sys_now()
 {
-  return ticks;
+  uint32_t primask = __get_PRIMASK();
+  uint32_t now;
+
+  __disable_irq();
+  now = time_elapsed();
+  now = ticks + (frac + now) / cycles_per_ms;
+  __set_PRIMASK(primask);
+
+  return now;
+}
+
+/* free-running CPU cycle count (wraps every ~89 s at 48 MHz), for PERF_START/PERF_STOP */
+uint32_t time_cycles(void)
+{
+  uint32_t primask = __get_PRIMASK();
+  uint32_t now;
+
+  __disable_irq();
+  now = time_elapsed();
+  now += cycles;
+  __set_PRIMASK(primask);
+
+  return now;
+}
+
+/* a USB reset starts a new trace; every other milestone keeps its first timestamp */
+void time_link_mark(time_link_t phase)
+{
+  if (TIME_LINK_USB_RESET == phase)
+  {
+    for (int i = 0; i < TIME_LINK_PHASES; i++)
+      time_link[i] = 0;
+  }
+
+  if (!time_link[phase])
+    time_link[phase] = sys_now();
+}
+
+/*
+  called with interrupts masked, so an event arriving just before cannot be missed;
+  returns once an interrupt is pending, or after ms (at most SysTick's 24-bit range)
+*/
+void time_sleep(uint32_t ms)
+{
+  uint32_t slept;
+
+  if (ms > (SysTick_LOAD_RELOAD_Msk + 1) / cycles_per_ms)
+    ms = (SysTick_LOAD_RELOAD_Msk + 1) / cycles_per_ms;
+
+  if (0 == ms)
+    return;
+
+  /* close the running period and start one that ends at the deadline */
+  time_account(time_elapsed());
+  SysTick->LOAD = ms * cycles_per_ms - 1;
+  SysTick->VAL = 0;
+  period = ms * cycles_per_ms;
+
+  __WFI();
+
+  if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk)
+    slept = period;
+  else
+    slept = period - 1 - SysTick->VAL;
+
+  slept += sleep_frac;
+  time_duty.sleep += slept / cycles_per_ms;
+  sleep_frac = slept % cycles_per_ms;
+  time_duty.wakeups++;
 }
@@ -1,11 +1,39 @@
 #ifndef TIME_H_
 #define TIME_H_
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef struct
+{
+  uint32_t sleep;   /* ms spent in time_sleep(); the remainder of sys_now() was busy */
+  uint32_t wakeups;
+} time_duty_t;
+
+extern time_duty_t time_duty;
+
+/* bring-up milestones, in the order a host normally reaches them */
+typedef enum
+{
+  TIME_LINK_USB_RESET,
+  TIME_LINK_SET_CONFIGURATION,
+  TIME_LINK_RNDIS_INITIALIZE,
+  TIME_LINK_PACKET_FILTER,
+  TIME_LINK_DHCP_OFFER,
+  TIME_LINK_DHCP_ACK,
+  TIME_LINK_PHASES
+} time_link_t;
+
+/* sys_now() when each milestone was first reached since the last USB reset, 0 if not yet */
+extern uint32_t time_link[TIME_LINK_PHASES];
+
 void    time_init(void);
+void    time_sleep(uint32_t ms);
+uint32_t time_cycles(void);
+void    time_link_mark(time_link_t phase);
 
 #ifdef __cplusplus
 }
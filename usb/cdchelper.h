@@ -30,6 +30,7 @@
 
 #define CDC_CMD_PACKET_SIZE      8
 #define USB_FS_MAX_PACKET_SIZE   64
+#define CDC_NOTIFY_PACKET_SIZE   16 /* a ConnectionSpeedChange notification in one packet (NCM, ECM) */
 
 struct cdc_interface
 {
@@ -164,6 +165,15 @@ struct cdc_interface
   #define RNDIS_ITF_PROTOCOL 3
 #endif
 
+/*
+  the control interface itself is marked CDC ACM with a vendor protocol, as Linux's RNDIS gadget does:
+  Windows binds RNDIS through the IAD's class, while Linux hosts pass over the configuration for the
+  CDC-ECM one (usb_choose_configuration) and rndis_host still matches it if chosen by hand
+*/
+#define RNDIS_CTL_ITF_CLASS    0x02
+#define RNDIS_CTL_ITF_SUBCLASS 0x02
+#define RNDIS_CTL_ITF_PROTOCOL 0xFF
+
 #define RNDIS_DESCRIPTOR(COMMAND_ITF, DATA_ITF, COMMAND_EP, DATAOUT_EP, DATAIN_EP) \
     { \
       .cdc_association = { \
@@ -185,9 +195,9 @@ struct cdc_interface
         .bInterfaceNumber   = COMMAND_ITF,                                     /* Number of Interface */ \
         .bAlternateSetting  = 0x00,                                            /* Alternate setting */ \
         .bNumEndpoints      = 0x01,                                            /* One endpoints used */ \
-        .bInterfaceClass    = RNDIS_ITF_CLASS,                                 /* Wireless */ \
-        .bInterfaceSubclass = RNDIS_ITF_SUBCLASS,                              /* Radio Frequency */ \
-        .bInterfaceProtocol = RNDIS_ITF_PROTOCOL,                              /* RNDIS */ \
+        .bInterfaceClass    = RNDIS_CTL_ITF_CLASS,                             /* Communications */ \
+        .bInterfaceSubclass = RNDIS_CTL_ITF_SUBCLASS,                          /* Abstract Control Model */ \
+        .bInterfaceProtocol = RNDIS_CTL_ITF_PROTOCOL,                          /* vendor: RNDIS */ \
         .iInterface         = 0x00,                                            \
       }, \
  \
@@ -269,4 +279,272 @@ struct cdc_interface
       } \
     },
 
+struct ncm_interface
+{
+  struct interface_association_descriptor cdc_association;
+  struct interface_descriptor             ctl_interface;
+  struct cdc_functional_descriptor_header cdc_header;
+  struct cdc_union_functional_descriptor  cdc_union;
+  struct cdc_enet_functional_descriptor   cdc_enet;
+  struct cdc_ncm_functional_descriptor    cdc_ncm;
+  struct endpoint_descriptor              ctl_ep;
+  struct interface_descriptor             dat_interface_off;
+  struct interface_descriptor             dat_interface;
+  struct endpoint_descriptor              ep_out;
+  struct endpoint_descriptor              ep_in;
+};
+
+/* macro to help generate CDC NCM USB descriptors; the data interface carries traffic only in alternate setting 1 */
+
+#define NCM_DESCRIPTOR(COMMAND_ITF, DATA_ITF, COMMAND_EP, DATAOUT_EP, DATAIN_EP, MAC_STR, MAX_SEGMENT) \
+    { \
+      .cdc_association = { \
+        /*Interface Association Descriptor */ \
+        .bLength            = sizeof(struct interface_association_descriptor), /* Interface Association Descriptor size */ \
+        .bDescriptorType    = USB_INTERFACE_ASSOCIATION_DESCRIPTOR,            /* Interface Association */ \
+        .bFirstInterface    = COMMAND_ITF,                                     /* First Interface of Association */ \
+        .bInterfaceCount    = 0x02,                                            /* quantity of interfaces in association */ \
+        .bFunctionClass     = 0x02,                                            /* Communication Interface Class */ \
+        .bFunctionSubClass  = 0x0D,                                            /* Network Control Model */ \
+        .bFunctionProtocol  = 0x00,                                            \
+        .iFunction          = 0x00,                                            \
+      }, \
+ \
+      .ctl_interface = { \
+        /*Interface Descriptor */ \
+        .bLength            = sizeof(struct interface_descriptor),             /* Interface Descriptor size */ \
+        .bDescriptorType    = USB_INTERFACE_DESCRIPTOR,                        /* Interface */ \
+        .bInterfaceNumber   = COMMAND_ITF,                                     /* Number of Interface */ \
+        .bAlternateSetting  = 0x00,                                            /* Alternate setting */ \
+        .bNumEndpoints      = 0x01,                                            /* One endpoints used */ \
+        .bInterfaceClass    = 0x02,                                            /* Communication Interface Class */ \
+        .bInterfaceSubclass = 0x0D,                                            /* Network Control Model */ \
+        .bInterfaceProtocol = 0x00,                                            \
+        .iInterface         = 0x00,                                            \
+      }, \
+ \
+      .cdc_header = { \
+        /*Header Functional Descriptor*/ \
+        .bFunctionLength    = sizeof(struct cdc_functional_descriptor_header), /* Endpoint Descriptor size */ \
+        .bDescriptorType    = 0x24,                                            /* CS_INTERFACE */ \
+        .bDescriptorSubtype = 0x00,                                            /* Header Func Desc */ \
+        .bcdCDC             = USB_UINT16(0x0110),                              /* spec release number */ \
+      }, \
+ \
+      .cdc_union = { \
+        /*Union Functional Descriptor*/ \
+        .bFunctionLength    = sizeof(struct cdc_union_functional_descriptor),  \
+        .bDescriptorType    = 0x24,                                            /* CS_INTERFACE */ \
+        .bDescriptorSubtype = 0x06,                                            /* Union func desc */ \
+        .bMasterInterface   = COMMAND_ITF,                                     /* Communication class interface */ \
+        .bSlaveInterface0   = DATA_ITF,                                        /* Data Class Interface */ \
+      }, \
+ \
+      .cdc_enet = { \
+        /*Ethernet Networking Functional Descriptor*/ \
+        .bFunctionLength     = sizeof(struct cdc_enet_functional_descriptor),  \
+        .bDescriptorType     = 0x24,                                           /* CS_INTERFACE */ \
+        .bDescriptorSubtype  = 0x0F,                                           /* Ethernet Networking Func Desc */ \
+        .iMACAddress         = MAC_STR,                                        /* string with the host's MAC-address in hex */ \
+        .bmEthernetStatistics = { 0, 0, 0, 0 },                                \
+        .wMaxSegmentSize     = USB_UINT16(MAX_SEGMENT),                        \
+        .wMCFilters          = USB_UINT16(0),                                  /* no multicast filtering */ \
+        .bNumberPowerFilters = 0,                                              \
+      }, \
+ \
+      .cdc_ncm = { \
+        /*NCM Functional Descriptor*/ \
+        .bFunctionLength    = sizeof(struct cdc_ncm_functional_descriptor),    \
+        .bDescriptorType    = 0x24,                                            /* CS_INTERFACE */ \
+        .bDescriptorSubtype = 0x1A,                                            /* NCM Func Desc */ \
+        .bcdNcmVersion      = USB_UINT16(0x0100),                              \
+        .bmNetworkCapabilities = 0x01,                                         /* SetEthernetPacketFilter */ \
+      }, \
+ \
+      .ctl_ep = { \
+        /* Command Endpoint Descriptor*/ \
+        .bLength            = sizeof(struct endpoint_descriptor),              /* Endpoint Descriptor size */ \
+        .bDescriptorType    = USB_ENDPOINT_DESCRIPTOR,                         /* Endpoint */ \
+        .bEndpointAddress   = COMMAND_EP,                                      \
+        .bmAttributes       = 0x03,                                            /* Interrupt */ \
+        .wMaxPacketSize     = USB_UINT16(CDC_NOTIFY_PACKET_SIZE),              \
+        .bInterval          = 0x01,                                            \
+      }, \
+ \
+      .dat_interface_off = { \
+        /*Data class interface descriptor, no endpoints*/ \
+        .bLength            = sizeof(struct interface_descriptor),             /* Endpoint Descriptor size */ \
+        .bDescriptorType    = USB_INTERFACE_DESCRIPTOR,                        \
+        .bInterfaceNumber   = DATA_ITF,                                        /* Number of Interface */ \
+        .bAlternateSetting  = 0x00,                                            /* Alternate setting */ \
+        .bNumEndpoints      = 0x00,                                            \
+        .bInterfaceClass    = 0x0A,                                            /* CDC */ \
+        .bInterfaceSubclass = 0x00,                                            \
+        .bInterfaceProtocol = 0x01,                                            /* Network Transfer Block */ \
+        .iInterface         = 0x00,                                            \
+      }, \
+ \
+      .dat_interface = { \
+        /*Data class interface descriptor*/ \
+        .bLength            = sizeof(struct interface_descriptor),             /* Endpoint Descriptor size */ \
+        .bDescriptorType    = USB_INTERFACE_DESCRIPTOR,                        \
+        .bInterfaceNumber   = DATA_ITF,                                        /* Number of Interface */ \
+        .bAlternateSetting  = 0x01,                                            /* Alternate setting */ \
+        .bNumEndpoints      = 0x02,                                            /* Two endpoints used */ \
+        .bInterfaceClass    = 0x0A,                                            /* CDC */ \
+        .bInterfaceSubclass = 0x00,                                            \
+        .bInterfaceProtocol = 0x01,                                            /* Network Transfer Block */ \
+        .iInterface         = 0x00,                                            \
+      }, \
+ \
+      .ep_out = { \
+        /* Data Endpoint OUT Descriptor */ \
+        .bLength            = sizeof(struct endpoint_descriptor),              /* Endpoint Descriptor size */ \
+        .bDescriptorType    = USB_ENDPOINT_DESCRIPTOR,                         /* Endpoint */ \
+        .bEndpointAddress   = DATAOUT_EP,                                      \
+        .bmAttributes       = 0x02,                                            /* Bulk */ \
+        .wMaxPacketSize     = USB_UINT16(USB_FS_MAX_PACKET_SIZE),              \
+        .bInterval          = 0x00,                                            /* ignore for Bulk transfer */ \
+      }, \
+ \
+      .ep_in = { \
+        /* Data Endpoint IN Descriptor*/ \
+        .bLength            = sizeof(struct endpoint_descriptor),              /* Endpoint Descriptor size */ \
+        .bDescriptorType    = USB_ENDPOINT_DESCRIPTOR,                         /* Endpoint */ \
+        .bEndpointAddress   = DATAIN_EP,                                       \
+        .bmAttributes       = 0x02,                                            /* Bulk */ \
+        .wMaxPacketSize     = USB_UINT16(USB_FS_MAX_PACKET_SIZE),              \
+        .bInterval          = 0x00                                             /* ignore for Bulk transfer */ \
+      } \
+    },
+
+struct ecm_interface
+{
+  struct interface_association_descriptor cdc_association;
+  struct interface_descriptor             ctl_interface;
+  struct cdc_functional_descriptor_header cdc_header;
+  struct cdc_union_functional_descriptor  cdc_union;
+  struct cdc_enet_functional_descriptor   cdc_enet;
+  struct endpoint_descriptor              ctl_ep;
+  struct interface_descriptor             dat_interface_off;
+  struct interface_descriptor             dat_interface;
+  struct endpoint_descriptor              ep_out;
+  struct endpoint_descriptor              ep_in;
+};
+
+/* macro to help generate CDC ECM USB descriptors; the data interface carries traffic only in alternate setting 1 */
+
+#define ECM_DESCRIPTOR(COMMAND_ITF, DATA_ITF, COMMAND_EP, DATAOUT_EP, DATAIN_EP, MAC_STR, MAX_SEGMENT) \
+    { \
+      .cdc_association = { \
+        /*Interface Association Descriptor */ \
+        .bLength            = sizeof(struct interface_association_descriptor), /* Interface Association Descriptor size */ \
+        .bDescriptorType    = USB_INTERFACE_ASSOCIATION_DESCRIPTOR,            /* Interface Association */ \
+        .bFirstInterface    = COMMAND_ITF,                                     /* First Interface of Association */ \
+        .bInterfaceCount    = 0x02,                                            /* quantity of interfaces in association */ \
+        .bFunctionClass     = 0x02,                                            /* Communication Interface Class */ \
+        .bFunctionSubClass  = 0x06,                                            /* Ethernet Networking Control Model */ \
+        .bFunctionProtocol  = 0x00,                                            \
+        .iFunction          = 0x00,                                            \
+      }, \
+ \
+      .ctl_interface = { \
+        /*Interface Descriptor */ \
+        .bLength            = sizeof(struct interface_descriptor),             /* Interface Descriptor size */ \
+        .bDescriptorType    = USB_INTERFACE_DESCRIPTOR,                        /* Interface */ \
+        .bInterfaceNumber   = COMMAND_ITF,                                     /* Number of Interface */ \
+        .bAlternateSetting  = 0x00,                                            /* Alternate setting */ \
+        .bNumEndpoints      = 0x01,                                            /* One endpoints used */ \
+        .bInterfaceClass    = 0x02,                                            /* Communication Interface Class */ \
+        .bInterfaceSubclass = 0x06,                                            /* Ethernet Networking Control Model */ \
+        .bInterfaceProtocol = 0x00,                                            \
+        .iInterface         = 0x00,                                            \
+      }, \
+ \
+      .cdc_header = { \
+        /*Header Functional Descriptor*/ \
+        .bFunctionLength    = sizeof(struct cdc_functional_descriptor_header), /* Endpoint Descriptor size */ \
+        .bDescriptorType    = 0x24,                                            /* CS_INTERFACE */ \
+        .bDescriptorSubtype = 0x00,                                            /* Header Func Desc */ \
+        .bcdCDC             = USB_UINT16(0x0110),                              /* spec release number */ \
+      }, \
+ \
+      .cdc_union = { \
+        /*Union Functional Descriptor*/ \
+        .bFunctionLength    = sizeof(struct cdc_union_functional_descriptor),  \
+        .bDescriptorType    = 0x24,                                            /* CS_INTERFACE */ \
+        .bDescriptorSubtype = 0x06,                                            /* Union func desc */ \
+        .bMasterInterface   = COMMAND_ITF,                                     /* Communication class interface */ \
+        .bSlaveInterface0   = DATA_ITF,                                        /* Data Class Interface */ \
+      }, \
+ \
+      .cdc_enet = { \
+        /*Ethernet Networking Functional Descriptor*/ \
+        .bFunctionLength     = sizeof(struct cdc_enet_functional_descriptor),  \
+        .bDescriptorType     = 0x24,                                           /* CS_INTERFACE */ \
+        .bDescriptorSubtype  = 0x0F,                                           /* Ethernet Networking Func Desc */ \
+        .iMACAddress         = MAC_STR,                                        /* string with the host's MAC-address in hex */ \
+        .bmEthernetStatistics = { 0, 0, 0, 0 },                                \
+        .wMaxSegmentSize     = USB_UINT16(MAX_SEGMENT),                        \
+        .wMCFilters          = USB_UINT16(0),                                  /* no multicast filtering */ \
+        .bNumberPowerFilters = 0,                                              \
+      }, \
+ \
+      .ctl_ep = { \
+        /* Command Endpoint Descriptor*/ \
+        .bLength            = sizeof(struct endpoint_descriptor),              /* Endpoint Descriptor size */ \
+        .bDescriptorType    = USB_ENDPOINT_DESCRIPTOR,                         /* Endpoint */ \
+        .bEndpointAddress   = COMMAND_EP,                                      \
+        .bmAttributes       = 0x03,                                            /* Interrupt */ \
+        .wMaxPacketSize     = USB_UINT16(CDC_NOTIFY_PACKET_SIZE),              \
+        .bInterval          = 0x01,                                            \
+      }, \
+ \
+      .dat_interface_off = { \
+        /*Data class interface descriptor, no endpoints*/ \
+        .bLength            = sizeof(struct interface_descriptor),             /* Endpoint Descriptor size */ \
+        .bDescriptorType    = USB_INTERFACE_DESCRIPTOR,                        \
+        .bInterfaceNumber   = DATA_ITF,                                        /* Number of Interface */ \
+        .bAlternateSetting  = 0x00,                                            /* Alternate setting */ \
+        .bNumEndpoints      = 0x00,                                            \
+        .bInterfaceClass    = 0x0A,                                            /* CDC */ \
+        .bInterfaceSubclass = 0x00,                                            \
+        .bInterfaceProtocol = 0x00,                                            \
+        .iInterface         = 0x00,                                            \
+      }, \
+ \
+      .dat_interface = { \
+        /*Data class interface descriptor*/ \
+        .bLength            = sizeof(struct interface_descriptor),             /* Endpoint Descriptor size */ \
+        .bDescriptorType    = USB_INTERFACE_DESCRIPTOR,                        \
+        .bInterfaceNumber   = DATA_ITF,                                        /* Number of Interface */ \
+        .bAlternateSetting  = 0x01,                                            /* Alternate setting */ \
+        .bNumEndpoints      = 0x02,                                            /* Two endpoints used */ \
+        .bInterfaceClass    = 0x0A,                                            /* CDC */ \
+        .bInterfaceSubclass = 0x00,                                            \
+        .bInterfaceProtocol = 0x00,                                            \
+        .iInterface         = 0x00,                                            \
+      }, \
+ \
+      .ep_out = { \
+        /* Data Endpoint OUT Descriptor */ \
+        .bLength            = sizeof(struct endpoint_descriptor),              /* Endpoint Descriptor size */ \
+        .bDescriptorType    = USB_ENDPOINT_DESCRIPTOR,                         /* Endpoint */ \
+        .bEndpointAddress   = DATAOUT_EP,                                      \
+        .bmAttributes       = 0x02,                                            /* Bulk */ \
+        .wMaxPacketSize     = USB_UINT16(USB_FS_MAX_PACKET_SIZE),              \
+        .bInterval          = 0x00,                                            /* ignore for Bulk transfer */ \
+      }, \
+ \
+      .ep_in = { \
+        /* Data Endpoint IN Descriptor*/ \
+        .bLength            = sizeof(struct endpoint_descriptor),              /* Endpoint Descriptor size */ \
+        .bDescriptorType    = USB_ENDPOINT_DESCRIPTOR,                         /* Endpoint */ \
+        .bEndpointAddress   = DATAIN_EP,                                       \
+        .bmAttributes       = 0x02,                                            /* Bulk */ \
+        .wMaxPacketSize     = USB_UINT16(USB_FS_MAX_PACKET_SIZE),              \
+        .bInterval          = 0x00                                             /* ignore for Bulk transfer */ \
+      } \
+    },
+
 #endif /* __CDC_HELPER_H */
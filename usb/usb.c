@@ -56,6 +56,31 @@ enum
   USB_DEVICE_EPCFG_EPTYPE_DUAL_BANK   = 5,
 };
 
+enum
+{
+  USB_EVENT_SEND,
+  USB_EVENT_RECV,
+  USB_EVENT_CONFIGURATION,
+  USB_EVENT_RESET,
+  USB_EVENT_INTERFACE,
+};
+
+enum
+{
+  USB_CTRL_SETUP,      // waiting for a SETUP packet
+  USB_CTRL_DATA_IN,    // sending the data stage
+  USB_CTRL_DATA_OUT,   // receiving the data stage
+  USB_CTRL_STATUS_IN,  // sending the zero-length status packet
+  USB_CTRL_STATUS_OUT, // waiting for the host's zero-length status packet
+};
+
+// Completions queued by the interrupt handler for usb_task(); at most two
+// transfers per data endpoint are pending
+#define USB_EVENT_QUEUE_LEN  16
+
+// Control endpoint interrupts, which USB_IRQ_MODE leaves to usb_task()
+#define USB_CTRL_EPINTS  (USB_DEVICE_EPINTENSET_RXSTP | USB_DEVICE_EPINTENSET_TRCPT0 | USB_DEVICE_EPINTENSET_TRCPT1)
+
 enum
 {
   USB_DEVICE_PCKSIZE_SIZE_8    = 0,
@@ -79,11 +104,34 @@ typedef union
   };
 } udc_mem_t;
 
+typedef struct
+{
+  uint8_t  type;
+  uint8_t  ep;
+  uint16_t size;
+} usb_event_t;
+
 /*- Variables ---------------------------------------------------------------*/
 static alignas(4) udc_mem_t udc_mem[USB_EPT_NUM];
 static alignas(4) uint8_t usb_ctrl_in_buf[64];
-static alignas(4) uint8_t usb_ctrl_out_buf[128];
+static alignas(4) uint8_t usb_ctrl_out_buf[USB_CTRL_OUT_SIZE];
 static void (*usb_control_recv_callback)(uint8_t *data, int size);
+static int usb_ctrl_state;
+static int usb_ctrl_length;            // wLength of the request in progress
+static const uint8_t *usb_ctrl_in_data; // data stage still to be sent
+static int usb_ctrl_in_size;
+static bool usb_ctrl_in_zlp;           // data stage ends short of wLength on a packet boundary
+static uint32_t usb_ctrl_address;      // DADD to apply once the SET_ADDRESS status stage is out
+static uint8_t usb_bank_next[USB_EPT_NUM]; // dual-bank: bank armed by the next usb_send()/usb_recv()
+static uint8_t usb_bank_done[USB_EPT_NUM]; // dual-bank: bank expected to complete next
+
+#if USB_IRQ_MODE
+// single producer (USB_Handler), single consumer (usb_task)
+static usb_event_t usb_events[USB_EVENT_QUEUE_LEN];
+static volatile unsigned usb_event_head, usb_event_tail;
+static volatile bool usb_ctrl_pending; // bus reset or control endpoint interrupt masked for usb_task()
+uint32_t usb_events_lost;              // completions dropped because the queue was full
+#endif
 
 /*- Implementations ---------------------------------------------------------*/
 
@@ -126,7 +174,9 @@ void usb_hw_init(void)
     usb_reset_endpoint(i, USB_OUT_ENDPOINT);
   }
 
-  //NVIC_EnableIRQ(USB_IRQn);
+#if USB_IRQ_MODE
+  NVIC_EnableIRQ(USB_IRQn);
+#endif
 }
 
 //-----------------------------------------------------------------------------
@@ -144,10 +194,19 @@ void usb_detach(void)
 //-----------------------------------------------------------------------------
 void usb_reset_endpoint(int ep, int dir)
 {
+  // a dual-bank endpoint completes on both TRCPT flags
+  int flags = (USB_DEVICE_EPCFG_EPTYPE_DUAL_BANK == ((USB_IN_ENDPOINT == dir) ?
+      USB->DEVICE.DeviceEndpoint[ep].EPCFG.bit.EPTYPE1 : USB->DEVICE.DeviceEndpoint[ep].EPCFG.bit.EPTYPE0)) ?
+      (USB_DEVICE_EPINTFLAG_TRCPT0 | USB_DEVICE_EPINTFLAG_TRCPT1) :
+      ((USB_IN_ENDPOINT == dir) ? USB_DEVICE_EPINTFLAG_TRCPT1 : USB_DEVICE_EPINTFLAG_TRCPT0);
+
   if (USB_IN_ENDPOINT == dir)
     USB->DEVICE.DeviceEndpoint[ep].EPCFG.bit.EPTYPE1 = USB_DEVICE_EPCFG_EPTYPE_DISABLED;
   else
     USB->DEVICE.DeviceEndpoint[ep].EPCFG.bit.EPTYPE0 = USB_DEVICE_EPCFG_EPTYPE_DISABLED;
+
+  // a transfer that completed just before is not reported for the disabled endpoint
+  USB->DEVICE.DeviceEndpoint[ep].EPINTFLAG.reg = flags;
 }
 
 //-----------------------------------------------------------------------------
@@ -190,6 +249,33 @@ void usb_configure_endpoint(usb_endpoint_descriptor_t *desc)
   else
     type = USB_DEVICE_EPCFG_EPTYPE_INTERRUPT;
 
+  if (USB_DEVICE_EPCFG_EPTYPE_BULK == type && (USB_DUAL_BANK_ENDPOINTS & (1 << ep)))
+  {
+    // Both banks serve the one direction and are used alternately, starting
+    // with bank 0; the other direction of this endpoint number is unusable.
+    USB->DEVICE.DeviceEndpoint[ep].EPINTENSET.reg = USB_DEVICE_EPINTENSET_TRCPT0 | USB_DEVICE_EPINTENSET_TRCPT1;
+    USB->DEVICE.DeviceEndpoint[ep].EPSTATUSCLR.reg = USB_DEVICE_EPSTATUSCLR_CURBK;
+    udc_mem[ep].bank[0].PCKSIZE.bit.SIZE = size;
+    udc_mem[ep].bank[1].PCKSIZE.bit.SIZE = size;
+    usb_bank_next[ep] = 0;
+    usb_bank_done[ep] = 0;
+
+    if (USB_IN_ENDPOINT == dir)
+    {
+      USB->DEVICE.DeviceEndpoint[ep].EPCFG.bit.EPTYPE1 = USB_DEVICE_EPCFG_EPTYPE_DUAL_BANK;
+      USB->DEVICE.DeviceEndpoint[ep].EPSTATUSCLR.bit.DTGLIN = 1;
+      USB->DEVICE.DeviceEndpoint[ep].EPSTATUSCLR.reg = USB_DEVICE_EPSTATUSCLR_BK0RDY | USB_DEVICE_EPSTATUSCLR_BK1RDY;
+    }
+    else
+    {
+      USB->DEVICE.DeviceEndpoint[ep].EPCFG.bit.EPTYPE0 = USB_DEVICE_EPCFG_EPTYPE_DUAL_BANK;
+      USB->DEVICE.DeviceEndpoint[ep].EPSTATUSCLR.bit.DTGLOUT = 1;
+      USB->DEVICE.DeviceEndpoint[ep].EPSTATUSSET.reg = USB_DEVICE_EPSTATUSSET_BK0RDY | USB_DEVICE_EPSTATUSSET_BK1RDY;
+    }
+
+    return;
+  }
+
   if (USB_IN_ENDPOINT == dir)
   {
     USB->DEVICE.DeviceEndpoint[ep].EPCFG.bit.EPTYPE1 = type;
@@ -269,84 +355,236 @@ void usb_endpoint_clear_feature(int ep, int dir)
 //-----------------------------------------------------------------------------
 void usb_set_address(int address)
 {
-  USB->DEVICE.DADD.reg = USB_DEVICE_DADD_ADDEN | USB_DEVICE_DADD_DADD(address);
+  // the status stage still goes out at the old address
+  usb_ctrl_address = USB_DEVICE_DADD_ADDEN | USB_DEVICE_DADD_DADD(address);
 }
 
 //-----------------------------------------------------------------------------
 void usb_send(int ep, uint8_t *data, int size)
 {
-  udc_mem[ep].in.ADDR.reg = (uint32_t)data;
-  udc_mem[ep].in.PCKSIZE.bit.BYTE_COUNT = size;
-  udc_mem[ep].in.PCKSIZE.bit.MULTI_PACKET_SIZE = 0;
+  int bank = 1;
+
+  if (USB_DEVICE_EPCFG_EPTYPE_DUAL_BANK == USB->DEVICE.DeviceEndpoint[ep].EPCFG.bit.EPTYPE1)
+  {
+    bank = usb_bank_next[ep];
+    usb_bank_next[ep] = bank ^ 1;
+  }
 
-  USB->DEVICE.DeviceEndpoint[ep].EPSTATUSSET.bit.BK1RDY = 1;
+  udc_mem[ep].bank[bank].ADDR.reg = (uint32_t)data;
+  udc_mem[ep].bank[bank].PCKSIZE.bit.BYTE_COUNT = size;
+  udc_mem[ep].bank[bank].PCKSIZE.bit.MULTI_PACKET_SIZE = 0;
+
+  USB->DEVICE.DeviceEndpoint[ep].EPSTATUSSET.reg = USB_DEVICE_EPSTATUSSET_BK0RDY << bank;
 }
 
 //-----------------------------------------------------------------------------
 void usb_recv(int ep, uint8_t *data, int size)
 {
-  udc_mem[ep].out.ADDR.reg = (uint32_t)data;
-  udc_mem[ep].out.PCKSIZE.bit.MULTI_PACKET_SIZE = size;
-  udc_mem[ep].out.PCKSIZE.bit.BYTE_COUNT = 0;
+  int bank = 0;
+
+  if (USB_DEVICE_EPCFG_EPTYPE_DUAL_BANK == USB->DEVICE.DeviceEndpoint[ep].EPCFG.bit.EPTYPE0)
+  {
+    bank = usb_bank_next[ep];
+    usb_bank_next[ep] = bank ^ 1;
+  }
+
+  udc_mem[ep].bank[bank].ADDR.reg = (uint32_t)data;
+  udc_mem[ep].bank[bank].PCKSIZE.bit.MULTI_PACKET_SIZE = size;
+  udc_mem[ep].bank[bank].PCKSIZE.bit.BYTE_COUNT = 0;
 
-  USB->DEVICE.DeviceEndpoint[ep].EPSTATUSCLR.bit.BK0RDY = 1;
+  USB->DEVICE.DeviceEndpoint[ep].EPSTATUSCLR.reg = USB_DEVICE_EPSTATUSCLR_BK0RDY << bank;
 }
 
 //-----------------------------------------------------------------------------
-void usb_control_send_zlp(void)
+static void usb_dispatch(int type, int ep, int size)
 {
-  udc_mem[0].in.PCKSIZE.bit.BYTE_COUNT = 0;
-  USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.reg = USB_DEVICE_EPINTFLAG_TRCPT1;
-  USB->DEVICE.DeviceEndpoint[0].EPSTATUSSET.bit.BK1RDY = 1;
+  if (USB_EVENT_SEND == type)
+    usb_send_callback(ep);
+  else if (USB_EVENT_RECV == type)
+    usb_recv_callback(ep, size);
+  else if (USB_EVENT_CONFIGURATION == type)
+    usb_configuration_callback(size);
+  else if (USB_EVENT_INTERFACE == type)
+    usb_interface_callback(ep, size);
+  else
+    usb_reset_callback();
+}
+
+//-----------------------------------------------------------------------------
+// Data endpoint completion, queued in the interrupt with USB_IRQ_MODE
+static void usb_event(int type, int ep, int size)
+{
+#if USB_IRQ_MODE
+  usb_event_t *event = &usb_events[usb_event_head % USB_EVENT_QUEUE_LEN];
+
+  if (usb_event_head - usb_event_tail >= USB_EVENT_QUEUE_LEN)
+  {
+    usb_events_lost++;
+    return;
+  }
 
-  while (0 == USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.bit.TRCPT1);
+  event->type = type;
+  event->ep = ep;
+  event->size = size;
+  // the slot must be filled before usb_task() can see it
+  __DMB();
+  usb_event_head++;
+#else
+  usb_dispatch(type, ep, size);
+#endif
 }
 
+#if USB_IRQ_MODE
 //-----------------------------------------------------------------------------
-void usb_control_stall(void)
+static void usb_flush_events(void)
 {
-  USB->DEVICE.DeviceEndpoint[0].EPSTATUSSET.bit.STALLRQ1 = 1;
+  while (usb_event_tail != usb_event_head)
+  {
+    usb_event_t *event = &usb_events[usb_event_tail % USB_EVENT_QUEUE_LEN];
+
+    __DMB();
+    usb_dispatch(event->type, event->ep, event->size);
+    // done with the slot before the interrupt may reuse it
+    __DMB();
+    usb_event_tail++;
+  }
 }
+#endif
 
 //-----------------------------------------------------------------------------
-void usb_control_send(uint8_t *data, int size)
+// Reset or configuration change; the control endpoint is serviced from
+// usb_task() in either mode, so class code runs in the main loop
+static void usb_control_event(int type, int ep, int size)
 {
-  // USB controller does not have access to the flash memory, so here we do
-  // a manual multi-packet transfer. This way data can be located in in
-  // the flash memory (big constant descriptors).
+#if USB_IRQ_MODE
+  // completions queued before it belong to the old state
+  usb_flush_events();
+#endif
+  usb_dispatch(type, ep, size);
+}
 
-  while (size)
+//-----------------------------------------------------------------------------
+void usb_post_configuration(int config)
+{
+  usb_control_event(USB_EVENT_CONFIGURATION, 0, config);
+}
+
+//-----------------------------------------------------------------------------
+void usb_post_interface(int interface, int alt)
+{
+  // the interface number travels in the ep field
+  usb_control_event(USB_EVENT_INTERFACE, interface, alt);
+}
+
+//-----------------------------------------------------------------------------
+static void usb_dual_bank_task(int ep, int flags)
+{
+  // TRCPTn flags completion of bank n; report them in the order the banks were armed
+  while (flags & (USB_DEVICE_EPINTFLAG_TRCPT0 << usb_bank_done[ep]))
   {
-    int transfer_size = LIMIT(size, usb_device_descriptor.bMaxPacketSize0);
+    int bank = usb_bank_done[ep];
 
-    for (int i = 0; i < transfer_size; i++)
-      usb_ctrl_in_buf[i] = data[i];
+    flags &= ~(USB_DEVICE_EPINTFLAG_TRCPT0 << bank);
+    usb_bank_done[ep] = bank ^ 1;
+    USB->DEVICE.DeviceEndpoint[ep].EPINTFLAG.reg = USB_DEVICE_EPINTFLAG_TRCPT0 << bank;
 
-    udc_mem[0].in.ADDR.reg = (uint32_t)usb_ctrl_in_buf;
-    udc_mem[0].in.PCKSIZE.bit.BYTE_COUNT = transfer_size;
-    udc_mem[0].in.PCKSIZE.bit.MULTI_PACKET_SIZE = 0;
+    if (USB_DEVICE_EPCFG_EPTYPE_DUAL_BANK == USB->DEVICE.DeviceEndpoint[ep].EPCFG.bit.EPTYPE1)
+      usb_event(USB_EVENT_SEND, ep, 0);
+    else
+      usb_event(USB_EVENT_RECV, ep, udc_mem[ep].bank[bank].PCKSIZE.bit.BYTE_COUNT);
+  }
+}
 
-    USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.reg = USB_DEVICE_EPINTFLAG_TRCPT1;
-    USB->DEVICE.DeviceEndpoint[0].EPSTATUSSET.bit.BK1RDY = 1;
+//-----------------------------------------------------------------------------
+static void usb_control_in(const uint8_t *data, int size)
+{
+  udc_mem[0].in.ADDR.reg = (uint32_t)data;
+  udc_mem[0].in.PCKSIZE.bit.BYTE_COUNT = size;
+  udc_mem[0].in.PCKSIZE.bit.MULTI_PACKET_SIZE = 0;
+
+  USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.reg = USB_DEVICE_EPINTFLAG_TRCPT1;
+  USB->DEVICE.DeviceEndpoint[0].EPSTATUSSET.bit.BK1RDY = 1;
+}
+
+//-----------------------------------------------------------------------------
+static void usb_control_send_next(void)
+{
+  const uint8_t *data = usb_ctrl_in_data;
+  int size = usb_ctrl_in_size;
 
-    while (0 == USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.bit.TRCPT1);
+  if (0 == size)
+  {
+    if (usb_ctrl_in_zlp)
+    {
+      usb_ctrl_in_zlp = false;
+      usb_control_in(usb_ctrl_in_buf, 0);
+    }
+    else
+    {
+      usb_ctrl_state = USB_CTRL_STATUS_OUT;
+    }
+    return;
+  }
 
-    size -= transfer_size;
-    data += transfer_size;
+  // USB controller does not have access to the flash memory, so data there
+  // (big constant descriptors) is staged a packet at a time; word-aligned RAM
+  // goes out in place as one multi-packet transfer
+  if ((uint32_t)data >= HMCRAMC0_ADDR && 0 == ((uint32_t)data & 3))
+  {
+    usb_control_in(data, size);
   }
+  else
+  {
+    size = LIMIT(size, usb_device_descriptor.bMaxPacketSize0);
+    memcpy(usb_ctrl_in_buf, data, size);
+    usb_control_in(usb_ctrl_in_buf, size);
+  }
+
+  usb_ctrl_in_data += size;
+  usb_ctrl_in_size -= size;
+}
+
+//-----------------------------------------------------------------------------
+void usb_control_send_zlp(void)
+{
+  usb_ctrl_state = USB_CTRL_STATUS_IN;
+  usb_control_in(usb_ctrl_in_buf, 0);
+}
+
+//-----------------------------------------------------------------------------
+void usb_control_stall(void)
+{
+  USB->DEVICE.DeviceEndpoint[0].EPSTATUSSET.bit.STALLRQ1 = 1;
+}
+
+//-----------------------------------------------------------------------------
+// Returns at once; the data stage proceeds from usb_task() completions, so
+// data must stay put until then (static or long-lived, not on the stack)
+void usb_control_send(uint8_t *data, int size)
+{
+  usb_ctrl_in_data = data;
+  usb_ctrl_in_size = size;
+  usb_ctrl_in_zlp = (size < usb_ctrl_length) && (0 == size % usb_device_descriptor.bMaxPacketSize0);
+  usb_ctrl_state = USB_CTRL_DATA_IN;
+  usb_control_send_next();
 }
 
 //-----------------------------------------------------------------------------
 void usb_control_recv(void (*callback)(uint8_t *data, int size))
 {
+  int packet = usb_device_descriptor.bMaxPacketSize0;
+
+  // the controller gathers the packets itself; rounding up to a whole packet
+  // ends the transfer on wLength even when no short packet follows
+  udc_mem[0].out.PCKSIZE.bit.MULTI_PACKET_SIZE = (usb_ctrl_length + packet - 1) / packet * packet;
+
   usb_control_recv_callback = callback;
+  usb_ctrl_state = USB_CTRL_DATA_OUT;
 }
 
 //-----------------------------------------------------------------------------
-void usb_task(void)
+static void usb_control_service(void)
 {
-  int flags, epints;
-
   if (USB->DEVICE.INTFLAG.bit.EORST)
   {
     USB->DEVICE.INTFLAG.reg = USB_DEVICE_INTFLAG_EORST;
@@ -373,14 +611,60 @@ void usb_task(void)
 
     USB->DEVICE.DeviceEndpoint[0].EPINTENSET.bit.RXSTP = 1;
     USB->DEVICE.DeviceEndpoint[0].EPINTENSET.bit.TRCPT0 = 1;
+    USB->DEVICE.DeviceEndpoint[0].EPINTENSET.bit.TRCPT1 = 1;
+
+    usb_ctrl_state = USB_CTRL_SETUP;
+    usb_ctrl_address = 0;
+    usb_control_recv_callback = NULL;
+
+    usb_control_event(USB_EVENT_RESET, 0, 0);
+  }
+
+  if (USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.bit.TRCPT1)
+  {
+    USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.reg = USB_DEVICE_EPINTFLAG_TRCPT1;
+
+    if (USB_CTRL_DATA_IN == usb_ctrl_state)
+    {
+      usb_control_send_next();
+    }
+    else if (USB_CTRL_STATUS_IN == usb_ctrl_state)
+    {
+      if (usb_ctrl_address)
+      {
+        USB->DEVICE.DADD.reg = usb_ctrl_address;
+        usb_ctrl_address = 0;
+      }
+
+      usb_ctrl_state = USB_CTRL_SETUP;
+    }
   }
 
   if (USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.bit.RXSTP)
   {
     usb_request_t *request = (usb_request_t *)usb_ctrl_out_buf;
 
-    if (sizeof(usb_request_t) == udc_mem[0].out.PCKSIZE.bit.BYTE_COUNT)
+    // a SETUP aborts whatever transfer was still in progress
+    USB->DEVICE.DeviceEndpoint[0].EPSTATUSCLR.bit.BK1RDY = 1;
+    usb_ctrl_state = USB_CTRL_SETUP;
+    usb_ctrl_in_size = 0;
+    usb_ctrl_in_zlp = false;
+    usb_control_recv_callback = NULL;
+    udc_mem[0].out.PCKSIZE.bit.MULTI_PACKET_SIZE = sizeof(usb_ctrl_out_buf);
+
+    if (sizeof(usb_request_t) != udc_mem[0].out.PCKSIZE.bit.BYTE_COUNT)
     {
+      usb_control_stall();
+    }
+    else if (!(request->bmRequestType & USB_IN_ENDPOINT) && request->wLength > USB_CTRL_OUT_SIZE)
+    {
+      // would not fit usb_ctrl_out_buf
+      usb_control_stall();
+    }
+    else
+    {
+      usb_ctrl_length = request->wLength;
+
       if (usb_handle_standard_request(request))
       {
         udc_mem[0].out.PCKSIZE.bit.BYTE_COUNT = 0;
@@ -392,10 +676,6 @@ void usb_task(void)
         usb_control_stall();
       }
     }
-    else
-    {
-      usb_control_stall();
-    }
 
     USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.reg = USB_DEVICE_EPINTFLAG_RXSTP;
   }
@@ -407,10 +687,20 @@ void usb_task(void)
       usb_control_recv_callback = NULL;
       usb_control_send_zlp();
     }
+    else if (USB_CTRL_STATUS_OUT == usb_ctrl_state)
+    {
+      usb_ctrl_state = USB_CTRL_SETUP;
+    }
 
     USB->DEVICE.DeviceEndpoint[0].EPSTATUSSET.bit.BK0RDY = 1;
     USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.reg = USB_DEVICE_EPINTFLAG_TRCPT0;
   }
+}
+
+//-----------------------------------------------------------------------------
+static void usb_endpoint_service(void)
+{
+  int flags, epints;
 
   epints = USB->DEVICE.EPINTSMRY.reg;
 
@@ -419,12 +709,20 @@ void usb_task(void)
     flags = USB->DEVICE.DeviceEndpoint[i].EPINTFLAG.reg;
     epints &= ~(1 << i);
 
+    if ((USB_DUAL_BANK_ENDPOINTS & (1 << i)) &&
+        (USB_DEVICE_EPCFG_EPTYPE_DUAL_BANK == USB->DEVICE.DeviceEndpoint[i].EPCFG.bit.EPTYPE0 ||
+         USB_DEVICE_EPCFG_EPTYPE_DUAL_BANK == USB->DEVICE.DeviceEndpoint[i].EPCFG.bit.EPTYPE1))
+    {
+      usb_dual_bank_task(i, flags);
+      continue;
+    }
+
     if (flags & USB_DEVICE_EPINTFLAG_TRCPT0)
     {
       USB->DEVICE.DeviceEndpoint[i].EPSTATUSSET.bit.BK0RDY = 1;
       USB->DEVICE.DeviceEndpoint[i].EPINTFLAG.reg = USB_DEVICE_EPINTFLAG_TRCPT0;
   
-      usb_recv_callback(i, udc_mem[i].out.PCKSIZE.bit.BYTE_COUNT);
+      usb_event(USB_EVENT_RECV, i, udc_mem[i].out.PCKSIZE.bit.BYTE_COUNT);
     }
 
     if (flags & USB_DEVICE_EPINTFLAG_TRCPT1)
@@ -432,8 +730,56 @@ void usb_task(void)
       USB->DEVICE.DeviceEndpoint[i].EPSTATUSCLR.bit.BK1RDY = 1;
       USB->DEVICE.DeviceEndpoint[i].EPINTFLAG.reg = USB_DEVICE_EPINTFLAG_TRCPT1;
 
-      usb_send_callback(i);
+      usb_event(USB_EVENT_SEND, i, 0);
     }
   }
 }
 
+//-----------------------------------------------------------------------------
+#if USB_IRQ_MODE
+void USB_Handler(void)
+{
+  // bus resets and control requests reach class code (RNDIS OID handlers,
+  // lwIP's netif), so their interrupts are masked here and usb_task()
+  // services them; only data endpoint completions are handled in the interrupt
+  if (USB->DEVICE.INTFLAG.bit.EORST || (USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.reg & USB_CTRL_EPINTS))
+  {
+    USB->DEVICE.INTENCLR.reg = USB_DEVICE_INTENCLR_EORST;
+    USB->DEVICE.DeviceEndpoint[0].EPINTENCLR.reg = USB_CTRL_EPINTS;
+    usb_ctrl_pending = true;
+  }
+
+  usb_endpoint_service();
+}
+#endif
+
+//-----------------------------------------------------------------------------
+void usb_task(void)
+{
+#if USB_IRQ_MODE
+  if (usb_ctrl_pending)
+  {
+    usb_ctrl_pending = false;
+    usb_control_service();
+
+    // whatever arrived meanwhile interrupts again as soon as it is unmasked
+    USB->DEVICE.INTENSET.reg = USB_DEVICE_INTENSET_EORST;
+    USB->DEVICE.DeviceEndpoint[0].EPINTENSET.reg = USB_CTRL_EPINTS;
+  }
+
+  usb_flush_events();
+#else
+  usb_control_service();
+  usb_endpoint_service();
+#endif
+}
+
+//-----------------------------------------------------------------------------
+bool usb_task_pending(void)
+{
+#if USB_IRQ_MODE
+  return usb_ctrl_pending || (usb_event_tail != usb_event_head);
+#else
+  return true;
+#endif
+}
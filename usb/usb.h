@@ -37,6 +37,13 @@
 /*- Definitions -------------------------------------------------------------*/
 #define USB_EP_NUM  8
 
+// With USB_IRQ_MODE the USB interrupt services the data endpoints and
+// usb_task() runs the class callbacks it queued, along with bus resets and
+// control requests, which the interrupt leaves pending; otherwise usb_task() polls.
+#ifndef USB_IRQ_MODE
+#define USB_IRQ_MODE  0
+#endif
+
 /*- Prototypes --------------------------------------------------------------*/
 void usb_hw_init(void);
 void usb_attach(void);
@@ -54,9 +61,18 @@ void usb_control_send_zlp(void);
 void usb_control_stall(void);
 void usb_control_send(uint8_t *data, int size);
 void usb_control_recv(void (*callback)(uint8_t *data, int size));
+void usb_post_configuration(int config);
+void usb_post_interface(int interface, int alt);
 void usb_task(void);
+bool usb_task_pending(void);
+
+#if USB_IRQ_MODE
+extern uint32_t usb_events_lost;
+#endif
 
 void usb_configuration_callback(int config);
+void usb_reset_callback(void);
+void usb_interface_callback(int interface, int alt);
 
 #endif // _USB_H_
 
@@ -34,9 +34,9 @@ const alignas(4) usb_device_descriptor_t usb_device_descriptor =
   .bLength            = sizeof(usb_device_descriptor_t),
   .bDescriptorType    = USB_DEVICE_DESCRIPTOR,
   .bcdUSB             = 0x0200,
-  .bDeviceClass       = 0xE0,
-  .bDeviceSubClass    = 0,
-  .bDeviceProtocol    = 0,
+  .bDeviceClass       = 0xEF, // Miscellaneous, functions defined by their IADs
+  .bDeviceSubClass    = 2,
+  .bDeviceProtocol    = 1,
   .bMaxPacketSize0    = USB_FS_MAX_PACKET_SIZE,
   .idVendor           = 0x6666,
   .idProduct          = 0x8889,
@@ -44,7 +44,7 @@ const alignas(4) usb_device_descriptor_t usb_device_descriptor =
   .iManufacturer      = USB_STR_MANUFACTURER,
   .iProduct           = USB_STR_PRODUCT,
   .iSerialNumber      = USB_STR_SERIAL_NUMBER,
-  .bNumConfigurations = 1,
+  .bNumConfigurations = USB_CONFIG_COUNT,
 };
 
 const alignas(4) usb_configuration_hierarchy_t usb_configuration_hierarchy =
@@ -55,13 +55,49 @@ const alignas(4) usb_configuration_hierarchy_t usb_configuration_hierarchy =
     .bDescriptorType     = USB_CONFIGURATION_DESCRIPTOR,
     .wTotalLength        = sizeof(usb_configuration_hierarchy_t),
     .bNumInterfaces      = 2,
-    .bConfigurationValue = 1,
+#if USB_NCM
+    .bConfigurationValue = USB_CONFIG_NCM,
+#else
+    .bConfigurationValue = USB_CONFIG_RNDIS,
+#endif
     .iConfiguration      = 0,
     .bmAttributes        = 0x80,
     .bMaxPower           = 50, // 100 mA
   },
 
+#if USB_NCM
+  NCM_DESCRIPTOR(/* Command ITF */ 0x00, /* Data ITF */ 0x01, /* Command EP */ USB_IN_ENDPOINT | USB_NCM_EP_COMM, /* DataOut EP */ USB_OUT_ENDPOINT | USB_NCM_EP_RECV, /* DataIn EP */ USB_IN_ENDPOINT | USB_NCM_EP_SEND, /* MAC string */ USB_STR_MAC_ADDRESS, /* max segment */ USB_NCM_MAX_SEGMENT)
+#else
   RNDIS_DESCRIPTOR(/* Command ITF */ 0x00, /* Data ITF */ 0x01, /* Command EP */ USB_IN_ENDPOINT | USB_RNDIS_EP_COMM, /* DataOut EP */ USB_OUT_ENDPOINT | USB_RNDIS_EP_RECV, /* DataIn EP */ USB_IN_ENDPOINT | USB_RNDIS_EP_SEND)
+#endif
+};
+
+#if !USB_NCM
+// the same endpoints carrying plain Ethernet frames
+const alignas(4) usb_ecm_configuration_hierarchy_t usb_ecm_configuration_hierarchy =
+{
+  .configuration =
+  {
+    .bLength             = sizeof(usb_configuration_descriptor_t),
+    .bDescriptorType     = USB_CONFIGURATION_DESCRIPTOR,
+    .wTotalLength        = sizeof(usb_ecm_configuration_hierarchy_t),
+    .bNumInterfaces      = 2,
+    .bConfigurationValue = USB_CONFIG_ECM,
+    .iConfiguration      = 0,
+    .bmAttributes        = 0x80,
+    .bMaxPower           = 50, // 100 mA
+  },
+
+  ECM_DESCRIPTOR(/* Command ITF */ 0x00, /* Data ITF */ 0x01, /* Command EP */ USB_IN_ENDPOINT | USB_RNDIS_EP_COMM, /* DataOut EP */ USB_OUT_ENDPOINT | USB_RNDIS_EP_RECV, /* DataIn EP */ USB_IN_ENDPOINT | USB_RNDIS_EP_SEND, /* MAC string */ USB_STR_MAC_ADDRESS, /* max segment */ (ETH_HEADER_SIZE + RNDIS_MTU))
+};
+#endif
+
+const usb_configuration_descriptor_t *const usb_configurations[USB_CONFIG_COUNT] =
+{
+  &usb_configuration_hierarchy.configuration,
+#if !USB_NCM
+  &usb_ecm_configuration_hierarchy.configuration,
+#endif
 };
 
 const alignas(4) usb_string_descriptor_zero_t usb_string_descriptor_zero =
@@ -76,6 +112,11 @@ char usb_serial_number[16];
 const char *const usb_strings[] =
 {
   [USB_STR_MANUFACTURER]  = "Acme",
+#if USB_NCM
+  [USB_STR_PRODUCT]       = "NCM",
+#else
   [USB_STR_PRODUCT]       = "RNDIS",
+#endif
   [USB_STR_SERIAL_NUMBER] = usb_serial_number,
+  [USB_STR_MAC_ADDRESS]   = RNDIS_HWADDR_STRING,
 };
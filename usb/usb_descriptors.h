@@ -39,6 +39,7 @@ modified by:
 #include "usb.h"
 #include "usb_std.h"
 #include "usb_rndis.h"
+#include "usb_ncm.h"
 #include "cdchelper.h"
 
 /*- Definitions -------------------------------------------------------------*/
@@ -48,9 +49,27 @@ enum
   USB_STR_MANUFACTURER,
   USB_STR_PRODUCT,
   USB_STR_SERIAL_NUMBER,
+  USB_STR_MAC_ADDRESS,
   USB_STR_COUNT,
 };
 
+/* bConfigurationValue of each configuration; the first is also usb_configurations[0] */
+#if USB_NCM
+enum
+{
+  USB_CONFIG_NCM = 1,
+  USB_CONFIG_COUNT = 1,
+};
+#else
+/* Windows takes the first configuration; Linux skips it for the lighter CDC-ECM one (see RNDIS_CTL_ITF_CLASS) */
+enum
+{
+  USB_CONFIG_RNDIS = 1,
+  USB_CONFIG_ECM = 2,
+  USB_CONFIG_COUNT = 2,
+};
+#endif
+
 enum
 {
   USB_RNDIS_EP_SEND = 1,
@@ -58,16 +77,52 @@ enum
   USB_RNDIS_EP_COMM = 3,
 };
 
+/* the NCM build uses the same endpoints */
+enum
+{
+  USB_NCM_EP_SEND = USB_RNDIS_EP_SEND,
+  USB_NCM_EP_RECV = USB_RNDIS_EP_RECV,
+  USB_NCM_EP_COMM = USB_RNDIS_EP_COMM,
+};
+
+/*
+  bulk endpoints to run in ping-pong mode, e.g. (1 << USB_RNDIS_EP_SEND) | (1 << USB_RNDIS_EP_RECV),
+  so the host can move the next transfer while one is processed; off by default, as
+  frames then batch less (each armed bank goes out as soon as it can) and a bank's
+  buffer costs RAM, which host/rndis_bridge measured as a net loss in both directions
+*/
+#ifndef USB_DUAL_BANK_ENDPOINTS
+#define USB_DUAL_BANK_ENDPOINTS  0
+#endif
+
+/* longest control OUT data stage accepted (a multiple of 64); RNDIS SET_MSGs carry config strings and multicast lists */
+#ifndef USB_CTRL_OUT_SIZE
+#define USB_CTRL_OUT_SIZE  256
+#endif
+/* usb.c arms the OUT data stage for wLength rounded up to whole packets, which must still fit usb_ctrl_out_buf */
+_Static_assert(!(USB_CTRL_OUT_SIZE % USB_FS_MAX_PACKET_SIZE), "USB_CTRL_OUT_SIZE must be a multiple of the packet size");
+
 /*- Types -------------------------------------------------------------------*/
 typedef struct PACK
 {
   usb_configuration_descriptor_t                   configuration;
+#if USB_NCM
+  struct ncm_interface                             cdc;
+#else
   struct cdc_interface                             cdc;
+#endif
 } usb_configuration_hierarchy_t;
 
+typedef struct PACK
+{
+  usb_configuration_descriptor_t                   configuration;
+  struct ecm_interface                             cdc;
+} usb_ecm_configuration_hierarchy_t;
+
 //-----------------------------------------------------------------------------
 extern const usb_device_descriptor_t usb_device_descriptor;
 extern const usb_configuration_hierarchy_t usb_configuration_hierarchy;
+extern const usb_configuration_descriptor_t *const usb_configurations[USB_CONFIG_COUNT];
 extern const usb_string_descriptor_zero_t usb_string_descriptor_zero;
 extern const char *const usb_strings[];
 extern char usb_serial_number[16];
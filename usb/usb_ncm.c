@@ -0,0 +1,500 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Peter Lawrence
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+  CDC-NCM (Network Control Model) data path: frames travel in NTB16 transfer
+  blocks, each holding several datagrams, so small packets share a transfer
+  in both directions instead of costing one each as with RNDIS
+*/
+
+#include <stdbool.h>
+#include <stdalign.h>
+#include <string.h>
+#include <stddef.h>
+#include "utils.h"
+#include "usb.h"
+#include "usb_std.h"
+#include "usb_descriptors.h"
+#include "usb_ncm.h"
+#include "rndis.h"
+#include "time.h"
+#include "lwip/sys.h"
+
+#if USB_NCM
+
+/* frames lwIP may have waiting for the IN endpoint (power of two) */
+#ifndef USB_NCM_TX_QUEUE_LEN
+#define USB_NCM_TX_QUEUE_LEN 8
+#endif
+
+#define NCM_ALIGN(x)      (((x) + 3) & ~3)
+
+_Static_assert(!(USB_NCM_NTB_OUT_SIZE % USB_FS_MAX_PACKET_SIZE), "USB_NCM_NTB_OUT_SIZE must be a multiple of the packet size");
+_Static_assert(USB_NCM_NTB_OUT_SIZE >= sizeof(ncm_nth16_t) + sizeof(ncm_ndp16_t) + 2 * sizeof(ncm_datagram16_t) + USB_NCM_MAX_SEGMENT, "USB_NCM_NTB_OUT_SIZE too small for a full frame");
+
+static const alignas(4) ncm_ntb_parameters_t ntb_parameters =
+{
+  .wLength                 = sizeof(ncm_ntb_parameters_t),
+  .bmNtbFormatsSupported   = 0x01, /* NTB16 only */
+  .dwNtbInMaxSize          = USB_NCM_NTB_IN_SIZE,
+  .wNdpInDivisor           = 4,
+  .wNdpInPayloadRemainder  = 0,
+  .wNdpInAlignment         = 4,
+  .dwNtbOutMaxSize         = USB_NCM_NTB_OUT_SIZE,
+  .wNdpOutDivisor          = 4,
+  .wNdpOutPayloadRemainder = 0,
+  .wNdpOutAlignment        = 4,
+  .wNtbOutMaxDatagrams     = 0, /* no limit beyond dwNtbOutMaxSize */
+};
+
+/* data handed to USB peripheral must be 32-bit aligned and in RAM */
+static alignas(4) uint8_t transmitted[USB_NCM_TX_BANKS][USB_NCM_NTB_IN_SIZE];
+static alignas(4) uint8_t received[USB_NCM_RX_BANKS][USB_NCM_NTB_OUT_SIZE];
+static alignas(4) ncm_ntb_input_size_t ntb_input_size;
+static alignas(4) ncm_notification_t notify_speed =
+{
+  .bmRequestType     = 0xA1,
+  .bNotificationCode = NCM_NOTIFY_SPEED_CHANGE,
+  .wLength           = 8,
+  .data              = { RNDIS_LINK_SPEED, RNDIS_LINK_SPEED },
+};
+static alignas(4) ncm_notification_t notify_connect =
+{
+  .bmRequestType     = 0xA1,
+  .bNotificationCode = NCM_NOTIFY_NETWORK_CONNECTION,
+  .wValue            = 1, /* connected */
+};
+
+static bool data_on; /* the data interface is in alternate setting 1 */
+static bool notify_pending; /* the connection notification follows the speed change */
+static int ntb_in_max = USB_NCM_NTB_IN_SIZE;       /* may be lowered by SET_NTB_INPUT_SIZE */
+static int ntb_in_datagrams = USB_NCM_MAX_DATAGRAMS; /* likewise */
+static uint16_t ntb_sequence;
+static uint16_t packet_filter = NCM_FILTER_DIRECTED | NCM_FILTER_BROADCAST | NCM_FILTER_ALL_MULTICAST;
+
+static int recv_size[USB_NCM_RX_BANKS]; /* length of each received NTB until it is unpacked */
+static int recv_armed; /* OUT transfers armed */
+static int recv_held;  /* NTBs received but not yet unpacked */
+static int recv_next;  /* bank armed next */
+static int recv_done;  /* bank completing next */
+static int recv_parse; /* bank unpacked next */
+static bool recv_started; /* its NTH16 has been checked and recv_ndp/recv_entry are valid */
+static int recv_ndp;   /* NDP16 being walked */
+static int recv_entry; /* next datagram pointer in it */
+
+static struct pbuf *xmit_queue[USB_NCM_TX_QUEUE_LEN];
+static unsigned xmit_head, xmit_tail;
+
+static int xmit_inflight = USB_NCM_TX_BANKS; /* IN transfers armed (all of them until the data interface is on) */
+static int xmit_next;  /* bank armed next */
+
+usb_eth_stat_t usb_eth_stat;
+usb_ncm_stat_t usb_ncm_stat;
+
+static void usb_ncm_ep_send_callback(int size);
+static void usb_ncm_ep_recv_callback(int size);
+static void usb_ncm_ep_comm_callback(int size);
+static void usb_ncm_xmit_start(void);
+
+void usb_ncm_init(void)
+{
+  usb_set_callback(USB_NCM_EP_SEND, usb_ncm_ep_send_callback);
+  usb_set_callback(USB_NCM_EP_RECV, usb_ncm_ep_recv_callback);
+  usb_set_callback(USB_NCM_EP_COMM, usb_ncm_ep_comm_callback);
+}
+
+/* hand the datagrams of an NTB to lwIP; false if it ran out of buffers and must be resumed later */
+static bool usb_ncm_unpack(const uint8_t *ntb, int size)
+{
+  const ncm_nth16_t *nth = (const ncm_nth16_t *)ntb;
+  const ncm_ndp16_t *ndp;
+  struct pbuf *frame;
+
+  if (!recv_started)
+  {
+    if ( (size < (int)sizeof(ncm_nth16_t)) || (nth->dwSignature != NTH16_SIGNATURE) ||
+         (nth->wHeaderLength != sizeof(ncm_nth16_t)) || (nth->wBlockLength > size) )
+    {
+      usb_ncm_stat.ntb_bad++;
+      return true;
+    }
+
+    recv_started = true;
+    recv_ndp = nth->wNdpIndex;
+    recv_entry = 0;
+    usb_ncm_stat.ntb_out++;
+  }
+
+  if (nth->wBlockLength)
+    size = nth->wBlockLength;
+
+  while (recv_ndp)
+  {
+    int entries;
+
+    ndp = (const ncm_ndp16_t *)(ntb + recv_ndp);
+    if ( (recv_ndp & 3) || (recv_ndp + (int)sizeof(ncm_ndp16_t) > size) || (ndp->dwSignature != NDP16_SIGNATURE) ||
+         (ndp->wLength < sizeof(ncm_ndp16_t) + 2 * sizeof(ncm_datagram16_t)) || (recv_ndp + ndp->wLength > size) )
+    {
+      usb_ncm_stat.ntb_bad++;
+      break;
+    }
+
+    entries = (ndp->wLength - sizeof(ncm_ndp16_t)) / sizeof(ncm_datagram16_t);
+    for (; recv_entry < entries; recv_entry++)
+    {
+      int index = ndp->datagram[recv_entry].wDatagramIndex;
+      int length = ndp->datagram[recv_entry].wDatagramLength;
+
+      if (!index || !length)
+        break;
+
+      if ( (index + length > size) || (length < ETH_HEADER_SIZE) || (length > USB_NCM_MAX_SEGMENT) )
+      {
+        usb_eth_stat.rxbad++;
+        continue;
+      }
+
+      /*
+        every datagram is copied out, so the NTB buffer can be re-armed at once;
+        this gives up what usb_rndis.c saves by receiving into pool pbufs that
+        lwIP takes frames from in place, which for NTBs would need
+        PBUF_POOL_BUFSIZE >= USB_NCM_NTB_OUT_SIZE and would pin a whole NTB
+        for as long as any of its datagrams is held
+      */
+      frame = pbuf_alloc(PBUF_RAW, length, PBUF_POOL);
+      if (!frame)
+        return false;
+      pbuf_take(frame, ntb + index, length);
+
+      if (!usb_eth_recv_callback(frame))
+      {
+        pbuf_free(frame);
+        return false;
+      }
+
+      usb_eth_stat.rxok++;
+      usb_ncm_stat.dgram_out++;
+    }
+
+    /* NDPs must move forward through the NTB, which bounds the walk */
+    if (ndp->wNextNdpIndex && (ndp->wNextNdpIndex <= recv_ndp))
+    {
+      usb_ncm_stat.ntb_bad++;
+      break;
+    }
+
+    recv_ndp = ndp->wNextNdpIndex;
+    recv_entry = 0;
+  }
+
+  return true;
+}
+
+void usb_ncm_recv_renew(void)
+{
+  uint64_t rxok = usb_eth_stat.rxok;
+  PERF_START;
+
+  /* the oldest NTB first; one stalled for buffers keeps its bank until the main loop frees some */
+  while (recv_held)
+  {
+    if (!usb_ncm_unpack(received[recv_parse], recv_size[recv_parse]))
+      break;
+
+    recv_started = false;
+    recv_parse = (recv_parse + 1) % USB_NCM_RX_BANKS;
+    recv_held--;
+  }
+
+  /* polled from the main loop: only the calls that pass lwIP datagrams are timed */
+  if (usb_eth_stat.rxok != rxok)
+    PERF_STOP("usb_ncm_recv_renew");
+
+  while (data_on && (recv_armed + recv_held < USB_NCM_RX_BANKS))
+  {
+    usb_recv(USB_NCM_EP_RECV, received[recv_next], USB_NCM_NTB_OUT_SIZE);
+    recv_next = (recv_next + 1) % USB_NCM_RX_BANKS;
+    recv_armed++;
+  }
+}
+
+static void usb_ncm_ep_recv_callback(int size)
+{
+  recv_size[recv_done] = size;
+  recv_done = (recv_done + 1) % USB_NCM_RX_BANKS;
+  recv_armed--;
+  recv_held++;
+  usb_ncm_recv_renew();
+}
+
+static void usb_ncm_ep_send_callback(int size)
+{
+  (void)size;
+
+  xmit_inflight--;
+  usb_ncm_xmit_start();
+}
+
+static void usb_ncm_ep_comm_callback(int size)
+{
+  (void)size;
+
+  if (notify_pending)
+  {
+    notify_pending = false;
+    usb_send(USB_NCM_EP_COMM, (uint8_t *)&notify_connect, 8);
+  }
+}
+
+/* stop the data path; the endpoints were reset, so nothing armed will complete */
+static void usb_ncm_data_off(void)
+{
+  data_on = false;
+  notify_pending = false;
+
+  recv_armed = recv_held = 0;
+  recv_next = recv_done = recv_parse = 0;
+  recv_started = false;
+
+  xmit_inflight = USB_NCM_TX_BANKS;
+  xmit_next = 0;
+}
+
+void usb_reset_callback(void)
+{
+  time_link_mark(TIME_LINK_USB_RESET);
+
+  usb_ncm_data_off();
+}
+
+void usb_configuration_callback(int config)
+{
+  (void)config;
+
+  time_link_mark(TIME_LINK_SET_CONFIGURATION);
+
+  usb_ncm_data_off();
+  ntb_in_max = USB_NCM_NTB_IN_SIZE;
+  ntb_in_datagrams = USB_NCM_MAX_DATAGRAMS;
+}
+
+void usb_interface_callback(int interface, int alt)
+{
+  if (1 != interface)
+    return;
+
+  usb_ncm_data_off();
+
+  if (1 != alt)
+    return;
+
+  /* the host opens the data interface once it has read the NTB parameters */
+  data_on = true;
+  ntb_sequence = 0;
+
+  usb_ncm_recv_renew();
+
+  xmit_inflight = 0;
+  usb_ncm_xmit_start();
+
+  notify_pending = true;
+  usb_send(USB_NCM_EP_COMM, (uint8_t *)&notify_speed, sizeof(notify_speed));
+}
+
+static void usb_ncm_set_ntb_input_size(uint8_t *data, int size)
+{
+  ncm_ntb_input_size_t request = { 0 };
+
+  memcpy(&request, data, LIMIT(size, sizeof(request)));
+
+  /* never build an NTB larger than the host asked for, nor one too small for a full frame */
+  if (request.dwNtbInMaxSize >= sizeof(ncm_nth16_t) + sizeof(ncm_ndp16_t) + 2 * sizeof(ncm_datagram16_t) + USB_NCM_MAX_SEGMENT + 1)
+    ntb_in_max = LIMIT(request.dwNtbInMaxSize, USB_NCM_NTB_IN_SIZE);
+
+  ntb_in_datagrams = (size >= 6 && request.wNtbInMaxDatagrams) ? LIMIT(request.wNtbInMaxDatagrams, USB_NCM_MAX_DATAGRAMS) : USB_NCM_MAX_DATAGRAMS;
+}
+
+bool usb_class_handle_request(usb_request_t *request)
+{
+  int length = request->wLength;
+
+  if (0x20 != (request->bmRequestType & 0x60)) /* CLASS */
+    return false;
+
+  switch (request->bRequest)
+  {
+  case NCM_GET_NTB_PARAMETERS:
+    usb_control_send((uint8_t *)&ntb_parameters, LIMIT(length, sizeof(ntb_parameters)));
+    return true;
+
+  case NCM_GET_NTB_INPUT_SIZE:
+    ntb_input_size.dwNtbInMaxSize = ntb_in_max;
+    ntb_input_size.wNtbInMaxDatagrams = ntb_in_datagrams;
+    usb_control_send((uint8_t *)&ntb_input_size, LIMIT(length, sizeof(ntb_input_size)));
+    return true;
+
+  case NCM_SET_NTB_INPUT_SIZE:
+    if (length < 4)
+      return false;
+    usb_control_recv(usb_ncm_set_ntb_input_size);
+    return true;
+
+  case NCM_SET_ETHERNET_PACKET_FILTER:
+    packet_filter = request->wValue;
+    usb_control_send_zlp();
+    time_link_mark(TIME_LINK_PACKET_FILTER);
+    return true;
+  }
+
+  return false;
+}
+
+/* whether the host's packet filter lets a frame from the device through; there is no multicast list, so any group passes */
+static bool usb_ncm_packet_filter(const uint8_t *dst)
+{
+  if (packet_filter & NCM_FILTER_PROMISCUOUS)
+    return true;
+
+  if (!(dst[0] & 1))
+    return packet_filter & NCM_FILTER_DIRECTED;
+
+  if ((dst[0] & dst[1] & dst[2] & dst[3] & dst[4] & dst[5]) == 0xFF)
+    return packet_filter & NCM_FILTER_BROADCAST;
+
+  return packet_filter & (NCM_FILTER_ALL_MULTICAST | NCM_FILTER_MULTICAST);
+}
+
+/* pack queued frames into the next NTB: NTH16, 4-byte aligned datagrams, then the NDP16 */
+static void usb_ncm_xmit_next(void)
+{
+  uint8_t *ntb = transmitted[xmit_next];
+  ncm_nth16_t *nth = (ncm_nth16_t *)ntb;
+  ncm_ndp16_t *ndp;
+  ncm_datagram16_t datagram[USB_NCM_MAX_DATAGRAMS];
+  int size = sizeof(ncm_nth16_t), count = 0, ndp_index;
+
+  while ((xmit_head != xmit_tail) && (count < ntb_in_datagrams))
+  {
+    struct pbuf *p = xmit_queue[xmit_tail & (USB_NCM_TX_QUEUE_LEN - 1)];
+    int index = NCM_ALIGN(size);
+
+    /* room for the frame, the NDP16 with a terminating entry, and a byte of padding */
+    if ((NCM_ALIGN(index + p->tot_len) + (int)sizeof(ncm_ndp16_t) + (count + 2) * (int)sizeof(ncm_datagram16_t) + 1) > ntb_in_max)
+    {
+      if (count)
+        break;
+
+      /* cannot happen for frames within the MTU, but must not wedge the queue */
+      xmit_tail++;
+      pbuf_free(p);
+      usb_eth_stat.txbad++;
+      continue;
+    }
+
+    memset(ntb + size, 0, index - size);
+    size = index + usb_eth_xmit_copy(p, ntb + index, p->tot_len);
+    datagram[count].wDatagramIndex = index;
+    datagram[count].wDatagramLength = p->tot_len;
+
+    xmit_tail++;
+    pbuf_free(p);
+    count++;
+  }
+
+  /* every queued frame was dropped; an NTB without datagrams is of no use to the host */
+  if (0 == count)
+    return;
+
+  ndp_index = NCM_ALIGN(size);
+  memset(ntb + size, 0, ndp_index - size);
+  ndp = (ncm_ndp16_t *)(ntb + ndp_index);
+  ndp->dwSignature = NDP16_SIGNATURE;
+  ndp->wLength = sizeof(ncm_ndp16_t) + (count + 1) * sizeof(ncm_datagram16_t);
+  ndp->wNextNdpIndex = 0;
+  memcpy(ndp->datagram, datagram, count * sizeof(ncm_datagram16_t));
+  memset(&ndp->datagram[count], 0, sizeof(ncm_datagram16_t));
+  size = ndp_index + ndp->wLength;
+
+  /* without ZLPs, a block ending on a packet boundary would leave the host waiting; pad it */
+  if (!(size % USB_FS_MAX_PACKET_SIZE))
+    ntb[size++] = 0;
+
+  nth->dwSignature = NTH16_SIGNATURE;
+  nth->wHeaderLength = sizeof(ncm_nth16_t);
+  nth->wSequence = ntb_sequence++;
+  nth->wBlockLength = size;
+  nth->wNdpIndex = ndp_index;
+
+  usb_ncm_stat.ntb_in++;
+  usb_ncm_stat.dgram_in += count;
+
+  xmit_next = (xmit_next + 1) % USB_NCM_TX_BANKS;
+  xmit_inflight++;
+  usb_send(USB_NCM_EP_SEND, ntb, size);
+}
+
+static void usb_ncm_xmit_start(void)
+{
+  PERF_START;
+
+  /* with both banks busy, frames gather in the queue and go out together in the next NTB */
+  while ((xmit_inflight < USB_NCM_TX_BANKS) && (xmit_head != xmit_tail))
+    usb_ncm_xmit_next();
+
+  PERF_STOP("usb_ncm_xmit_start");
+}
+
+err_t usb_ncm_xmit_packet(struct pbuf *p)
+{
+  unsigned depth = xmit_head - xmit_tail;
+
+  /* lwIP keeps the Ethernet header in the first pbuf */
+  if (!usb_ncm_packet_filter((const uint8_t *)p->payload))
+  {
+    usb_eth_stat.txdrop_filter++;
+    return ERR_OK;
+  }
+
+  if (depth >= USB_NCM_TX_QUEUE_LEN)
+  {
+    usb_ncm_stat.dropped++;
+    usb_eth_stat.txbad++;
+    return ERR_MEM;
+  }
+
+  /* queued by reference; released once copied into an NTB */
+  pbuf_ref(p);
+  xmit_queue[xmit_head++ & (USB_NCM_TX_QUEUE_LEN - 1)] = p;
+  usb_eth_stat.txok++;
+
+  if (++depth > usb_ncm_stat.queue_max)
+    usb_ncm_stat.queue_max = depth;
+
+  usb_ncm_xmit_start();
+
+  return ERR_OK;
+}
+
+#endif // USB_NCM
@@ -0,0 +1,161 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Peter Lawrence
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _USB_NCM_H_
+#define _USB_NCM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "utils.h"
+#include "usb_std.h"
+#include "netif/etharp.h"
+#include "rndis.h"
+
+/* build the CDC-NCM function instead of RNDIS (both use the lwIP glue in app.c) */
+#ifndef USB_NCM
+#define USB_NCM 0
+#endif
+
+/* largest NTB the device sends; hosts must accept 2048 (the minimum dwNtbInMaxSize) */
+#ifndef USB_NCM_NTB_IN_SIZE
+#define USB_NCM_NTB_IN_SIZE   2048
+#endif
+
+/* largest NTB the host may send (a multiple of 64); one full frame plus NTB16 headers needs 1544 */
+#ifndef USB_NCM_NTB_OUT_SIZE
+#define USB_NCM_NTB_OUT_SIZE  1600
+#endif
+
+/* datagrams packed into one IN NTB */
+#ifndef USB_NCM_MAX_DATAGRAMS
+#define USB_NCM_MAX_DATAGRAMS 8
+#endif
+
+#define USB_NCM_MAX_SEGMENT   (ETH_HEADER_SIZE + RNDIS_MTU)
+
+/* transfers each bulk endpoint can have armed at once (see USB_DUAL_BANK_ENDPOINTS); one NTB buffer each */
+#define USB_NCM_TX_BANKS  ((USB_DUAL_BANK_ENDPOINTS & (1 << USB_NCM_EP_SEND)) ? 2 : 1)
+#define USB_NCM_RX_BANKS  ((USB_DUAL_BANK_ENDPOINTS & (1 << USB_NCM_EP_RECV)) ? 2 : 1)
+
+/* the NCM 1.0 wire format and class requests; host/bridge.c plays the host's side with them */
+#define NTH16_SIGNATURE 0x484D434E /* "NCMH" */
+#define NDP16_SIGNATURE 0x304D434E /* "NCM0", no CRC */
+
+enum
+{
+  NCM_SET_ETHERNET_PACKET_FILTER = 0x43,
+  NCM_GET_NTB_PARAMETERS         = 0x80,
+  NCM_GET_NTB_INPUT_SIZE         = 0x85,
+  NCM_SET_NTB_INPUT_SIZE         = 0x86,
+};
+
+enum
+{
+  NCM_NOTIFY_NETWORK_CONNECTION  = 0x00,
+  NCM_NOTIFY_SPEED_CHANGE        = 0x2A,
+};
+
+/* SET_ETHERNET_PACKET_FILTER bits */
+enum
+{
+  NCM_FILTER_PROMISCUOUS   = 0x01,
+  NCM_FILTER_ALL_MULTICAST = 0x02,
+  NCM_FILTER_DIRECTED      = 0x04,
+  NCM_FILTER_BROADCAST     = 0x08,
+  NCM_FILTER_MULTICAST     = 0x10,
+};
+
+typedef struct PACK
+{
+  uint32_t dwSignature;
+  uint16_t wHeaderLength;
+  uint16_t wSequence;
+  uint16_t wBlockLength;
+  uint16_t wNdpIndex;
+} ncm_nth16_t;
+
+typedef struct PACK
+{
+  uint16_t wDatagramIndex;
+  uint16_t wDatagramLength;
+} ncm_datagram16_t;
+
+typedef struct PACK
+{
+  uint32_t dwSignature;
+  uint16_t wLength;
+  uint16_t wNextNdpIndex;
+  ncm_datagram16_t datagram[];
+} ncm_ndp16_t;
+
+typedef struct PACK
+{
+  uint16_t wLength;
+  uint16_t bmNtbFormatsSupported;
+  uint32_t dwNtbInMaxSize;
+  uint16_t wNdpInDivisor;
+  uint16_t wNdpInPayloadRemainder;
+  uint16_t wNdpInAlignment;
+  uint16_t wReserved;
+  uint32_t dwNtbOutMaxSize;
+  uint16_t wNdpOutDivisor;
+  uint16_t wNdpOutPayloadRemainder;
+  uint16_t wNdpOutAlignment;
+  uint16_t wNtbOutMaxDatagrams;
+} ncm_ntb_parameters_t;
+
+typedef struct PACK
+{
+  uint32_t dwNtbInMaxSize;
+  uint16_t wNtbInMaxDatagrams;
+  uint16_t wReserved;
+} ncm_ntb_input_size_t;
+
+typedef struct PACK
+{
+  uint8_t  bmRequestType;
+  uint8_t  bNotificationCode;
+  uint16_t wValue;
+  uint16_t wIndex;
+  uint16_t wLength;
+  uint32_t data[2];
+} ncm_notification_t;
+
+void usb_ncm_init(void);
+void usb_ncm_recv_renew(void);
+err_t usb_ncm_xmit_packet(struct pbuf *p);
+
+typedef struct {
+  uint32_t ntb_in;      /* NTBs sent */
+  uint32_t ntb_out;     /* NTBs received */
+  uint32_t ntb_bad;     /* NTBs rejected for a bad header or datagram pointer */
+  uint32_t dgram_in;    /* datagrams packed into those NTBs */
+  uint32_t dgram_out;   /* datagrams taken out of them */
+  uint32_t dropped;     /* frames refused with ERR_MEM because the queue was full */
+  uint32_t queue_max;   /* queue high-water mark */
+} usb_ncm_stat_t;
+
+extern usb_ncm_stat_t usb_ncm_stat;
+
+#endif // _USB_NCM_H_
@@ -31,19 +31,95 @@
 #include "usb_std.h"
 #include "usb_rndis.h"
 #include "rndis.h"
+#include "time.h"
+#include "lwip/sys.h"
 
-static alignas(4) uint8_t received[RNDIS_BUFFER_SIZE];
-static alignas(4) uint8_t transmitted[RNDIS_BUFFER_SIZE];
+#if !USB_NCM
 
-static bool can_xmit;
+/* frames lwIP may have waiting for the IN endpoint (power of two) */
+#ifndef USB_RNDIS_TX_QUEUE_LEN
+#define USB_RNDIS_TX_QUEUE_LEN 8
+#endif
 
-/* provide window between usb_rndis.c and rndis.c */
-extern const uint8_t *const rndis_class_buffer;
-extern uint32_t *const rndis_class_msg_size;
-const int usb_rndis_xmit_size = RNDIS_BUFFER_SIZE;
+static alignas(4) uint8_t transmitted[USB_RNDIS_TX_BANKS][RNDIS_BUFFER_SIZE];
+
+/* the OUT endpoint receives straight into a pool buffer, so one must hold a whole transfer */
+_Static_assert(PBUF_POOL_BUFSIZE >= RNDIS_BUFFER_SIZE, "PBUF_POOL_BUFSIZE too small for RNDIS_BUFFER_SIZE");
+
+static struct pbuf *recv_pbuf[USB_RNDIS_RX_BANKS]; /* pool buffers for the OUT transfers, one per bank */
+static int recv_armed; /* OUT transfers armed */
+static int recv_next;  /* bank armed next */
+static int recv_done;  /* bank completing next */
+
+static struct
+{
+  struct pbuf *p;
+  uint32_t queued; /* sys_now() when lwIP handed it over */
+} xmit_queue[USB_RNDIS_TX_QUEUE_LEN];
+static unsigned xmit_head, xmit_tail;
+
+/* CDC-ECM requests and notifications */
+enum
+{
+  ECM_SET_ETHERNET_PACKET_FILTER = 0x43,
+  ECM_NOTIFY_NETWORK_CONNECTION  = 0x00,
+  ECM_NOTIFY_SPEED_CHANGE        = 0x2A,
+};
+
+/* SET_ETHERNET_PACKET_FILTER bits */
+enum
+{
+  ECM_FILTER_PROMISCUOUS   = 0x01,
+  ECM_FILTER_ALL_MULTICAST = 0x02,
+  ECM_FILTER_DIRECTED      = 0x04,
+  ECM_FILTER_BROADCAST     = 0x08,
+  ECM_FILTER_MULTICAST     = 0x10,
+};
+
+typedef struct PACK
+{
+  uint8_t  bmRequestType;
+  uint8_t  bNotificationCode;
+  uint16_t wValue;
+  uint16_t wIndex;
+  uint16_t wLength;
+  uint32_t data[2];
+} ecm_notification_t;
+
+/* data handed to USB peripheral must be 32-bit aligned and in RAM */
+static alignas(4) ecm_notification_t notify_speed =
+{
+  .bmRequestType     = 0xA1,
+  .bNotificationCode = ECM_NOTIFY_SPEED_CHANGE,
+  .wLength           = 8,
+  .data              = { RNDIS_LINK_SPEED, RNDIS_LINK_SPEED },
+};
+static alignas(4) ecm_notification_t notify_connect =
+{
+  .bmRequestType     = 0xA1,
+  .bNotificationCode = ECM_NOTIFY_NETWORK_CONNECTION,
+  .wValue            = 1, /* connected */
+};
+static bool notify_pending; /* the connection notification follows the speed change */
+
+static bool data_on; /* bulk endpoints in use: once configured for RNDIS, in alternate setting 1 for ECM */
+static uint32_t mode_since; /* sys_now() when usb_rndis_mode_stat[].active_ms was last brought up to date */
+
+static int xmit_inflight = USB_RNDIS_TX_BANKS; /* IN transfers armed (all of them until configured) */
+static int xmit_next;  /* bank armed next */
+static int xmit_done;  /* bank completing next */
+static struct pbuf *xmit_pbuf[USB_RNDIS_TX_BANKS]; /* frame sent in place from each bank, released on completion */
+
+int usb_rndis_xmit_size = RNDIS_BUFFER_SIZE;
+int usb_rndis_xmit_batch = RNDIS_MAX_PACKETS_PER_TRANSFER; /* may be lowered by the host's MaxPacketsPerTransfer parameter */
+
+usb_rndis_xmit_stat_t usb_rndis_xmit_stat;
+usb_eth_mode_t usb_rndis_mode = USB_ETH_MODE_RNDIS;
+usb_rndis_mode_stat_t usb_rndis_mode_stat[USB_ETH_MODES];
 
 static void usb_rndis_ep_send_callback(int size);
 static void usb_rndis_ep_recv_callback(int size);
+static void usb_rndis_ep_comm_callback(int size);
 
 void usb_rndis_report(const uint8_t *data, int size)
 {
@@ -54,43 +130,204 @@ void usb_rndis_init(void)
 {
   usb_set_callback(USB_RNDIS_EP_SEND, usb_rndis_ep_send_callback);
   usb_set_callback(USB_RNDIS_EP_RECV, usb_rndis_ep_recv_callback);
+  usb_set_callback(USB_RNDIS_EP_COMM, usb_rndis_ep_comm_callback);
+}
+
+/* charge the time since the last call to the current mode */
+static void usb_rndis_mode_tick(void)
+{
+  uint32_t now = sys_now();
+
+  if (data_on)
+    usb_rndis_mode_stat[usb_rndis_mode].active_ms += now - mode_since;
+  mode_since = now;
 }
 
 static void usb_rndis_send(uint8_t *data, int size)
 {
+  usb_rndis_mode_stat[usb_rndis_mode].tx_bytes += size;
   usb_send(USB_RNDIS_EP_SEND, data, size);
 }
 
 void usb_rndis_recv_renew(void)
 {
-  usb_recv(USB_RNDIS_EP_RECV, received, sizeof(received));
+  /* a received transfer not yet handed on keeps its bank unarmed: the host waits rather than frames being dropped */
+  rndis_recv_resume();
+
+  while (data_on && (recv_armed + rndis_recv_parked() < USB_RNDIS_RX_BANKS))
+  {
+    if (!recv_pbuf[recv_next])
+    {
+      recv_pbuf[recv_next] = pbuf_alloc(PBUF_RAW, RNDIS_BUFFER_SIZE, PBUF_POOL);
+      if (!recv_pbuf[recv_next])
+        return;
+    }
+
+    usb_recv(USB_RNDIS_EP_RECV, recv_pbuf[recv_next]->payload, RNDIS_BUFFER_SIZE);
+    recv_next = (recv_next + 1) % USB_RNDIS_RX_BANKS;
+    recv_armed++;
+  }
 }
 
-void usb_configuration_callback(int config)
+static void usb_rndis_xmit_start(void);
+static void usb_rndis_data_restart(bool on);
+
+void usb_reset_callback(void)
 {
-  (void)config;
+  time_link_mark(TIME_LINK_USB_RESET);
 
+  /* the reset aborted every transfer */
+  usb_rndis_data_restart(false);
+}
+
+/* (re)start the bulk endpoints after they were configured, or leave them idle */
+static void usb_rndis_data_restart(bool on)
+{
+  usb_rndis_mode_tick();
+  data_on = on;
+  notify_pending = false;
+
+  /* endpoints restart at bank 0; buffers still in recv_pbuf[] are simply re-armed */
+  rndis_recv_flush();
+  recv_armed = 0;
+  recv_next = 0;
+  recv_done = 0;
   usb_rndis_recv_renew();
-  can_xmit = true;
+
+  /* frames queued for a host that has gone would otherwise go out stale when it comes back */
+  if (!on)
+  {
+    while (xmit_head != xmit_tail)
+      pbuf_free(xmit_queue[xmit_tail++ & (USB_RNDIS_TX_QUEUE_LEN - 1)].p);
+    xmit_head = 0;
+    xmit_tail = 0;
+  }
+
+  for (int i = 0; i < USB_RNDIS_TX_BANKS; i++)
+  {
+    if (xmit_pbuf[i])
+    {
+      pbuf_free(xmit_pbuf[i]);
+      xmit_pbuf[i] = NULL;
+    }
+  }
+
+  xmit_inflight = on ? 0 : USB_RNDIS_TX_BANKS;
+  xmit_next = 0;
+  xmit_done = 0;
+  usb_rndis_xmit_start();
 }
 
+void usb_configuration_callback(int config)
+{
+  time_link_mark(TIME_LINK_SET_CONFIGURATION);
+
+  usb_rndis_mode_tick();
+  usb_rndis_mode = (USB_CONFIG_ECM == config) ? USB_ETH_MODE_ECM : USB_ETH_MODE_RNDIS;
+  usb_rndis_mode_stat[usb_rndis_mode].selected++;
+
+  /* RNDIS opens its filter with OID_GEN_CURRENT_PACKET_FILTER, ECM when the data interface comes up */
+  rndis_set_packet_filter(0);
+
+  /* ECM moves data only in alternate setting 1 of the data interface */
+  usb_rndis_data_restart(USB_ETH_MODE_RNDIS == usb_rndis_mode);
+}
+
+void usb_interface_callback(int interface, int alt)
+{
+  bool on = (USB_ETH_MODE_RNDIS == usb_rndis_mode) || (1 == alt);
+
+  if (1 != interface)
+    return;
+
+  /* SET_INTERFACE reconfigured the endpoints, and with them whatever was armed */
+  if (on && (USB_ETH_MODE_ECM == usb_rndis_mode))
+    rndis_set_packet_filter(NDIS_PACKET_TYPE_DIRECTED | NDIS_PACKET_TYPE_BROADCAST | NDIS_PACKET_TYPE_ALL_MULTICAST);
+
+  usb_rndis_data_restart(on);
+
+  /* Linux keeps an ECM link down until it is told it is connected */
+  if (on && (USB_ETH_MODE_ECM == usb_rndis_mode))
+  {
+    notify_pending = true;
+    usb_send(USB_RNDIS_EP_COMM, (uint8_t *)&notify_speed, sizeof(notify_speed));
+  }
+}
+
+static void usb_rndis_ep_comm_callback(int size)
+{
+  (void)size;
+
+  if (notify_pending)
+  {
+    notify_pending = false;
+    usb_send(USB_RNDIS_EP_COMM, (uint8_t *)&notify_connect, 8);
+  }
+}
 
 static void usb_rndis_ep_send_callback(int size)
 {
   (void)size;
 
-  can_xmit = true;
+  if (xmit_pbuf[xmit_done])
+  {
+    pbuf_free(xmit_pbuf[xmit_done]);
+    xmit_pbuf[xmit_done] = NULL;
+  }
+
+  xmit_done = (xmit_done + 1) % USB_RNDIS_TX_BANKS;
+  xmit_inflight--;
+  usb_rndis_xmit_start();
 }
 
 static void usb_rndis_ep_recv_callback(int size)
 {
-  rndis_recv_callback(received, size);
+  struct pbuf *p = recv_pbuf[recv_done];
+
+  recv_pbuf[recv_done] = NULL;
+  recv_done = (recv_done + 1) % USB_RNDIS_RX_BANKS;
+  recv_armed--;
+
+  usb_rndis_mode_tick();
+  usb_rndis_mode_stat[usb_rndis_mode].rx_bytes += size;
+
+  if (USB_ETH_MODE_ECM == usb_rndis_mode)
+    rndis_ecm_recv_callback(p, size);
+  else
+    rndis_recv_callback(p, size);
+}
+
+/* CDC-ECM's filter bits in NDIS terms; without a multicast filter list, MULTICAST means all of them */
+static uint32_t usb_rndis_ecm_filter(uint16_t filter)
+{
+  uint32_t ndis = 0;
+
+  if (filter & ECM_FILTER_PROMISCUOUS)
+    ndis |= NDIS_PACKET_TYPE_PROMISCUOUS;
+  if (filter & (ECM_FILTER_ALL_MULTICAST | ECM_FILTER_MULTICAST))
+    ndis |= NDIS_PACKET_TYPE_ALL_MULTICAST;
+  if (filter & ECM_FILTER_DIRECTED)
+    ndis |= NDIS_PACKET_TYPE_DIRECTED;
+  if (filter & ECM_FILTER_BROADCAST)
+    ndis |= NDIS_PACKET_TYPE_BROADCAST;
+
+  return ndis;
 }
 
 bool usb_class_handle_request(usb_request_t *request)
 {
   int length = request->wLength;
 
+  if (USB_ETH_MODE_ECM == usb_rndis_mode)
+  {
+    if ((0x20 != (request->bmRequestType & 0x60)) || (ECM_SET_ETHERNET_PACKET_FILTER != request->bRequest))
+      return false;
+
+    rndis_set_packet_filter(usb_rndis_ecm_filter(request->wValue));
+    usb_control_send_zlp();
+    return true;
+  }
+
   switch (request->bmRequestType & 0x60)
   {
   case 0x20: /* CLASS */
@@ -98,9 +335,17 @@ bool usb_class_handle_request(usb_request_t *request)
     {
       if (request->bmRequestType & 0x80)
       {
-        length = LIMIT(length, *rndis_class_msg_size);
         /* Device-to-Host */
-        usb_control_send((uint8_t *)rndis_class_buffer, length);
+        static const uint8_t no_response = 0;
+        uint32_t size;
+        const uint8_t *response = rndis_class_response(&size);
+
+        /* the spec answers a GET_ENCAPSULATED_RESPONSE with nothing queued with a single zero byte */
+        if (response)
+          usb_control_send((uint8_t *)response, LIMIT(length, size));
+        else
+          usb_control_send((uint8_t *)&no_response, 1);
+        rndis_class_response_done();
       }
       else
       {
@@ -114,29 +359,206 @@ bool usb_class_handle_request(usb_request_t *request)
   return false;
 }
 
-bool usb_rndis_can_xmit(void)
+/* space a frame occupies once packed, including padding to the advertised 32-bit alignment */
+static int usb_rndis_xmit_footprint(int size)
+{
+  return (sizeof(rndis_data_packet_t) + size + 3) & ~3;
+}
+
+static struct pbuf *usb_rndis_xmit_dequeue(void)
+{
+  int slot = xmit_tail++ & (USB_RNDIS_TX_QUEUE_LEN - 1);
+  uint32_t wait = sys_now() - xmit_queue[slot].queued;
+
+  usb_rndis_xmit_stat.wait_total += wait;
+  if (wait > usb_rndis_xmit_stat.wait_max)
+    usb_rndis_xmit_stat.wait_max = wait;
+
+  return xmit_queue[slot].p;
+}
+
+/* whether a frame ending on a packet boundary needs the padding byte that stands in for a ZLP (a transfer filling the host's buffer ends anyway) */
+static bool usb_rndis_xmit_pad(int size)
+{
+  return !(size % USB_FS_MAX_PACKET_SIZE) && (size < (int)usb_rndis_xmit_size);
+}
+
+/* whether there is a byte free behind the payload; only a pool pbuf's buffer size is known */
+static bool usb_rndis_xmit_tailroom(struct pbuf *p)
+{
+  uint8_t *end = (uint8_t *)p + LWIP_MEM_ALIGN_SIZE(sizeof(struct pbuf)) + LWIP_MEM_ALIGN_SIZE(PBUF_POOL_BUFSIZE);
+
+  return (PBUF_TYPE_ALLOC_SRC_MASK_STD_MEMP_PBUF_POOL == pbuf_get_allocsrc(p)) && ((uint8_t *)p->payload + p->len < end);
+}
+
+static void usb_rndis_xmit_submit(uint8_t *data, int size)
+{
+  xmit_next = (xmit_next + 1) % USB_RNDIS_TX_BANKS;
+  xmit_inflight++;
+  usb_rndis_send(data, size);
+}
+
+/*
+  a frame in a single RAM pbuf is sent without copying: the header goes into the
+  headroom reserved by PBUF_LINK_ENCAPSULATION_HLEN and the endpoint reads the pbuf directly;
+  chained, flash-backed (PBUF_ROM/PBUF_REF) and misaligned frames fall back to the copy,
+  which for TCP data enqueued by reference to flash is the only one it ever gets
+*/
+static bool usb_rndis_xmit_in_place(struct pbuf *p)
+{
+  rndis_data_packet_t *hdr;
+
+  if (p->next || !(p->type_internal & PBUF_TYPE_FLAG_STRUCT_DATA_CONTIGUOUS))
+    return false;
+
+  if (pbuf_add_header(p, sizeof(rndis_data_packet_t)))
+    return false;
+
+  hdr = (rndis_data_packet_t *)p->payload;
+  pbuf_remove_header(p, sizeof(rndis_data_packet_t));
+
+  if ((uint32_t)hdr & 3)
+    return false;
+
+  if (rndis_packet_header(hdr, p->tot_len) != p->tot_len)
+    return false;
+
+  if (usb_rndis_xmit_pad(hdr->MessageLength))
+  {
+    if (!usb_rndis_xmit_tailroom(p))
+      return false;
+    ((uint8_t *)p->payload)[p->len] = 0;
+    hdr->MessageLength++;
+  }
+
+  /* the reference taken when queued keeps lwIP (e.g. a TCP retransmission) away until completion */
+  usb_rndis_xmit_dequeue();
+  xmit_pbuf[xmit_next] = p;
+  usb_rndis_xmit_stat.zero_copy++;
+  usb_eth_stat.txinplace += p->tot_len;
+
+  usb_rndis_xmit_submit((uint8_t *)hdr, hdr->MessageLength);
+  return true;
+}
+
+/* CDC-ECM framing: one bare frame per transfer, in place where the endpoint can read it */
+static void usb_rndis_xmit_ecm(void)
 {
-  return can_xmit;
+  struct pbuf *p = usb_rndis_xmit_dequeue();
+  uint8_t *buffer = transmitted[xmit_next];
+  int size = LIMIT(p->tot_len, ETH_MAX_PACKET_SIZE);
+
+  if (!p->next && (p->type_internal & PBUF_TYPE_FLAG_STRUCT_DATA_CONTIGUOUS) && !((uint32_t)p->payload & 3) && (size % USB_FS_MAX_PACKET_SIZE))
+  {
+    xmit_pbuf[xmit_next] = p;
+    usb_rndis_xmit_stat.zero_copy++;
+    usb_eth_stat.txinplace += size;
+    usb_rndis_xmit_submit((uint8_t *)p->payload, size);
+    return;
+  }
+
+  usb_eth_xmit_copy(p, buffer, size);
+  pbuf_free(p);
+  usb_rndis_xmit_stat.copied++;
+
+  /* without ZLPs, a frame ending on a packet boundary gets a padding byte, which hosts drop like any Ethernet padding */
+  if (!(size % USB_FS_MAX_PACKET_SIZE))
+    buffer[size++] = 0;
+
+  usb_rndis_xmit_submit(buffer, size);
 }
 
-void usb_rndis_xmit_packet(uint8_t *header, int header_size, struct pbuf *p, int packet_size)
+/* arm the next IN transfer from the queue; needs a free bank and a queued frame */
+static void usb_rndis_xmit_next(void)
 {
-  struct pbuf *q;
-  uint8_t *data;
+  uint8_t *buffer = transmitted[xmit_next];
+  rndis_data_packet_t *hdr = NULL;
+  struct pbuf *p;
+  int size = 0, count = 0;
 
-  if (!can_xmit)
+  if (USB_ETH_MODE_ECM == usb_rndis_mode)
+  {
+    usb_rndis_xmit_ecm();
     return;
+  }
 
-  memcpy(transmitted, header, header_size);
+  /* a frame goes out in place, unless packing it with the next one saves a transfer */
+  p = xmit_queue[xmit_tail & (USB_RNDIS_TX_QUEUE_LEN - 1)].p;
+  if ( ((xmit_head - xmit_tail) == 1) || (usb_rndis_xmit_batch == 1) ||
+       ((usb_rndis_xmit_footprint(p->tot_len) + usb_rndis_xmit_footprint(xmit_queue[(xmit_tail + 1) & (USB_RNDIS_TX_QUEUE_LEN - 1)].p->tot_len)) > usb_rndis_xmit_size) )
+  {
+    if (usb_rndis_xmit_in_place(p))
+      return;
+  }
 
-  data = transmitted + header_size;
-  for(q = p; q != NULL; q = q->next)
+  while ((xmit_head != xmit_tail) && (count < usb_rndis_xmit_batch))
   {
-    memcpy(data, (char *)q->payload, q->len);
-    data += q->len;
-    if (q->tot_len == q->len) break;
+    int offset = (size + 3) & ~3;
+
+    p = xmit_queue[xmit_tail & (USB_RNDIS_TX_QUEUE_LEN - 1)].p;
+    if (count && ((offset + (int)sizeof(rndis_data_packet_t) + p->tot_len) > usb_rndis_xmit_size))
+      break;
+
+    if (count)
+    {
+      memset(buffer + size, 0, offset - size);
+      hdr->MessageLength += offset - size;
+    }
+
+    usb_rndis_xmit_dequeue();
+    hdr = (rndis_data_packet_t *)(buffer + offset);
+    size = offset + sizeof(rndis_data_packet_t);
+    size += usb_eth_xmit_copy(p, buffer + size, rndis_packet_header(hdr, p->tot_len));
+    pbuf_free(p);
+
+    count++;
+    usb_rndis_xmit_stat.copied++;
   }
 
-  can_xmit = false;
-  usb_rndis_send(transmitted, header_size + packet_size);
+  /* as for ECM; the byte counts in the last message's MessageLength, which may include padding */
+  if (usb_rndis_xmit_pad(size))
+  {
+    buffer[size++] = 0;
+    hdr->MessageLength++;
+  }
+
+  usb_rndis_xmit_submit(buffer, size);
+}
+
+static void usb_rndis_xmit_start(void)
+{
+  PERF_START;
+
+  while ((xmit_inflight < USB_RNDIS_TX_BANKS) && (xmit_head != xmit_tail))
+    usb_rndis_xmit_next();
+
+  PERF_STOP("usb_rndis_xmit_start");
+}
+
+err_t usb_rndis_xmit_packet(struct pbuf *p)
+{
+  unsigned depth = xmit_head - xmit_tail;
+  int slot;
+
+  if (depth >= USB_RNDIS_TX_QUEUE_LEN)
+  {
+    usb_rndis_xmit_stat.dropped++;
+    return ERR_MEM;
+  }
+
+  /* queued by reference; released once copied or sent */
+  pbuf_ref(p);
+  slot = xmit_head & (USB_RNDIS_TX_QUEUE_LEN - 1);
+  xmit_queue[slot].p = p;
+  xmit_queue[slot].queued = sys_now();
+  xmit_head++;
+
+  if (++depth > usb_rndis_xmit_stat.queue_max)
+    usb_rndis_xmit_stat.queue_max = depth;
+
+  usb_rndis_xmit_start();
+
+  return ERR_OK;
 }
+
+#endif // !USB_NCM
@@ -31,14 +31,44 @@
 #include "usb_std.h"
 #include "netif/etharp.h"
 
+/* transfers each bulk endpoint can have armed at once (see USB_DUAL_BANK_ENDPOINTS); a staging buffer per IN bank */
+#define USB_RNDIS_TX_BANKS  ((USB_DUAL_BANK_ENDPOINTS & (1 << USB_RNDIS_EP_SEND)) ? 2 : 1)
+#define USB_RNDIS_RX_BANKS  ((USB_DUAL_BANK_ENDPOINTS & (1 << USB_RNDIS_EP_RECV)) ? 2 : 1)
+
 void usb_rndis_init(void);
 
-void usb_rndis_recv_callback(const uint8_t *data, int size);
 void usb_rndis_recv_renew(void);
 
-bool usb_rndis_can_xmit(void);
-void usb_rndis_xmit_packet(uint8_t *header, int header_size, struct pbuf *p, int packet_size);
+err_t usb_rndis_xmit_packet(struct pbuf *p);
 
 void usb_rndis_report(const uint8_t *data, int size);
 
+typedef struct {
+  uint32_t zero_copy;  /* frames the IN endpoint sent straight out of their pbuf */
+  uint32_t copied;     /* frames copied into the staging buffer */
+  uint32_t dropped;    /* frames refused with ERR_MEM because the queue was full */
+  uint32_t queue_max;  /* queue high-water mark */
+  uint32_t wait_max;   /* longest a frame waited (ms) for its IN transfer to start */
+  uint32_t wait_total; /* sum of those waits; divide by zero_copy + copied for the mean */
+} usb_rndis_xmit_stat_t;
+
+extern usb_rndis_xmit_stat_t usb_rndis_xmit_stat;
+
+/* framing on the bulk endpoints, chosen by the configuration the host selects */
+typedef enum {
+  USB_ETH_MODE_RNDIS,
+  USB_ETH_MODE_ECM,
+  USB_ETH_MODES
+} usb_eth_mode_t;
+
+typedef struct {
+  uint64_t rx_bytes;   /* bytes of OUT transfers, framing included */
+  uint64_t tx_bytes;   /* bytes of IN transfers, likewise */
+  uint32_t active_ms;  /* time configured in this mode; bytes / active_ms gives kB/s */
+  uint32_t selected;   /* times the host chose this mode */
+} usb_rndis_mode_stat_t;
+
+extern usb_eth_mode_t usb_rndis_mode;
+extern usb_rndis_mode_stat_t usb_rndis_mode_stat[USB_ETH_MODES];
+
 #endif // _USB_RNDIS_H_
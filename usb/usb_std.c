@@ -35,12 +35,22 @@
 #include "usb_std.h"
 #include "usb_descriptors.h"
 
+/*- Definitions -------------------------------------------------------------*/
+#define USB_STR_MAX_LENGTH  32 // characters of a string descriptor; longer strings are cut short
+
 /*- Types -------------------------------------------------------------------*/
 typedef void (*usb_ep_callback_t)(int size);
 
 /*- Variables ---------------------------------------------------------------*/
 static usb_ep_callback_t usb_ep_callbacks[USB_EP_NUM];
 
+// usb_control_send() returns before the data stage is over, so replies built
+// here must outlive the request handler
+static alignas(4) uint8_t usb_string_buf[2 + USB_STR_MAX_LENGTH * 2];
+static uint8_t usb_config_reply;
+static uint8_t usb_interface_alt[8]; // alternate setting selected on each interface
+static uint16_t usb_status_reply;
+
 /*- Implementations ---------------------------------------------------------*/
 
 //-----------------------------------------------------------------------------
@@ -65,6 +75,55 @@ WEAK bool usb_class_handle_request(usb_request_t *request)
   return false;
 }
 
+//-----------------------------------------------------------------------------
+WEAK void usb_interface_callback(int interface, int alt)
+{
+  (void)interface;
+  (void)alt;
+}
+
+//-----------------------------------------------------------------------------
+// whether the configuration has the alternate setting; if so, (re)configure its endpoints
+static bool usb_select_interface(const usb_configuration_descriptor_t *config, int interface, int alt)
+{
+  bool exists = false;
+
+  // endpoints of the other settings are disabled first, so that one shared
+  // with the selected setting ends up configured
+  for (int pass = 0; pass < 2; pass++)
+  {
+    int size = config->wTotalLength;
+    usb_descriptor_header_t *desc = (usb_descriptor_header_t *)config;
+    bool match = false, selected = false;
+
+    while (size)
+    {
+      if (USB_INTERFACE_DESCRIPTOR == desc->bDescriptorType)
+      {
+        usb_interface_descriptor_t *itf = (usb_interface_descriptor_t *)desc;
+
+        match = (interface < 0 || itf->bInterfaceNumber == interface);
+        selected = match && (itf->bAlternateSetting == alt);
+        exists |= selected;
+      }
+      else if (USB_ENDPOINT_DESCRIPTOR == desc->bDescriptorType && match)
+      {
+        usb_endpoint_descriptor_t *ep = (usb_endpoint_descriptor_t *)desc;
+
+        if (0 == pass && !selected)
+          usb_reset_endpoint(ep->bEndpointAddress & USB_INDEX_MASK, ep->bEndpointAddress & USB_DIRECTION_MASK);
+        else if (1 == pass && selected)
+          usb_configure_endpoint(ep);
+      }
+
+      size -= desc->bLength;
+      desc = (usb_descriptor_header_t *)((uint8_t *)desc + desc->bLength);
+    }
+  }
+
+  return exists;
+}
+
 //-----------------------------------------------------------------------------
 bool usb_handle_standard_request(usb_request_t *request)
 {
@@ -84,11 +143,13 @@ bool usb_handle_standard_request(usb_request_t *request)
 
         usb_control_send((uint8_t *)&usb_device_descriptor, length);
       }
-      else if (USB_CONFIGURATION_DESCRIPTOR == type)
+      else if (USB_CONFIGURATION_DESCRIPTOR == type && index < USB_CONFIG_COUNT)
       {
-        length = LIMIT(length, usb_configuration_hierarchy.configuration.wTotalLength);
+        const usb_configuration_descriptor_t *config = usb_configurations[index];
+
+        length = LIMIT(length, config->wTotalLength);
 
-        usb_control_send((uint8_t *)&usb_configuration_hierarchy, length);
+        usb_control_send((uint8_t *)config, length);
       }
       else if (USB_STRING_DESCRIPTOR == type)
       {
@@ -101,9 +162,9 @@ bool usb_handle_standard_request(usb_request_t *request)
         else if (index < USB_STR_COUNT)
         {
           const char *str = usb_strings[index];
-          int len = strlen(str);
+          int len = LIMIT(strlen(str), USB_STR_MAX_LENGTH);
           int size = len*2 + 2;
-          alignas(4) uint8_t buf[size];
+          uint8_t *buf = usb_string_buf;
 
           buf[0] = size;
           buf[1] = USB_STRING_DESCRIPTOR;
@@ -137,51 +198,76 @@ bool usb_handle_standard_request(usb_request_t *request)
 
     case USB_CMD(OUT, DEVICE, STANDARD, SET_CONFIGURATION):
     {
+      if (request->wValue > USB_CONFIG_COUNT)
+        return false;
+
       usb_config = request->wValue;
 
       usb_control_send_zlp();
 
       if (usb_config)
       {
-        int size = usb_configuration_hierarchy.configuration.wTotalLength;
-        usb_descriptor_header_t *desc = (usb_descriptor_header_t *)&usb_configuration_hierarchy;
+        // bConfigurationValue n is usb_configurations[n - 1]; every interface starts in setting 0
+        usb_select_interface(usb_configurations[usb_config - 1], -1, 0);
+        memset(usb_interface_alt, 0, sizeof(usb_interface_alt));
+        usb_post_configuration(usb_config);
+      }
+    } break;
 
-        while (size)
-        {
-          if (USB_ENDPOINT_DESCRIPTOR == desc->bDescriptorType)
-            usb_configure_endpoint((usb_endpoint_descriptor_t *)desc);
+    case USB_CMD(IN, DEVICE, STANDARD, GET_CONFIGURATION):
+    {
+      usb_config_reply = usb_config;
+      usb_control_send(&usb_config_reply, sizeof(usb_config_reply));
+    } break;
 
-          size -= desc->bLength;
-          desc = (usb_descriptor_header_t *)((uint8_t *)desc + desc->bLength);
-        }
+    case USB_CMD(OUT, INTERFACE, STANDARD, SET_INTERFACE):
+    {
+      int interface = request->wIndex;
+      int alt = request->wValue;
 
-        usb_configuration_callback(usb_config);
+      if (usb_config && interface < (int)sizeof(usb_interface_alt) && usb_select_interface(usb_configurations[usb_config - 1], interface, alt))
+      {
+        usb_interface_alt[interface] = alt;
+        usb_control_send_zlp();
+        usb_post_interface(interface, alt);
+      }
+      else
+      {
+        return false;
       }
     } break;
 
-    case USB_CMD(IN, DEVICE, STANDARD, GET_CONFIGURATION):
+    case USB_CMD(IN, INTERFACE, STANDARD, GET_INTERFACE):
     {
-      uint8_t config = usb_config;
-      usb_control_send(&config, sizeof(config));
+      int interface = request->wIndex;
+
+      if (usb_config && interface < (int)sizeof(usb_interface_alt))
+      {
+        usb_config_reply = usb_interface_alt[interface];
+        usb_control_send(&usb_config_reply, sizeof(usb_config_reply));
+      }
+      else
+      {
+        return false;
+      }
     } break;
 
     case USB_CMD(IN, DEVICE, STANDARD, GET_STATUS):
     case USB_CMD(IN, INTERFACE, STANDARD, GET_STATUS):
     {
-      uint16_t status = 0;
-      usb_control_send((uint8_t *)&status, sizeof(status));
+      usb_status_reply = 0;
+      usb_control_send((uint8_t *)&usb_status_reply, sizeof(usb_status_reply));
     } break;
 
     case USB_CMD(IN, ENDPOINT, STANDARD, GET_STATUS):
     {
       int ep = request->wIndex & USB_INDEX_MASK;
       int dir = request->wIndex & USB_DIRECTION_MASK;
-      uint16_t status = 0;
 
       if (usb_endpoint_configured(ep, dir))
       {
-        status = usb_endpoint_get_status(ep, dir);
-        usb_control_send((uint8_t *)&status, sizeof(status));
+        usb_status_reply = usb_endpoint_get_status(ep, dir);
+        usb_control_send((uint8_t *)&usb_status_reply, sizeof(usb_status_reply));
       }
       else
       {
@@ -143,6 +143,15 @@ struct cdc_enet_functional_descriptor
   uint8_t bNumberPowerFilters;
 };
 
+struct cdc_ncm_functional_descriptor
+{
+  uint8_t bFunctionLength;
+  uint8_t bDescriptorType;
+  uint8_t bDescriptorSubtype;
+  struct usb_uint16 bcdNcmVersion;
+  uint8_t bmNetworkCapabilities;
+};
+
 struct interface_association_descriptor
 {
   uint8_t bLength;